@@ -0,0 +1,176 @@
+#pragma once
+
+#include <Eigen/Dense>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+// Arbitrary output variables written alongside the colour pass
+enum AovFlags : unsigned
+{
+    AovNone     = 0,
+    AovDepth    = 1 << 0,
+    AovNormal   = 1 << 1,
+    AovObjectId = 1 << 2,
+    AovAll      = AovDepth | AovNormal | AovObjectId
+};
+
+class AovBuffers
+{
+public:
+    inline AovBuffers() = default;
+
+    inline void        resize(std::size_t width, std::size_t height, unsigned mask);
+    inline unsigned    getMask() const { return mask_; }
+    inline std::size_t getWidth() const { return w_; }
+    inline std::size_t getHeight() const { return h_; }
+    // Rows of one output bottom-up, channels() floats per pixel, nullptr when it is disabled
+    inline const float* data(AovFlags aov) const;
+    inline static int   channels(AovFlags aov) { return aov == AovNormal ? 3 : 1; }
+
+    inline void setHit(std::size_t x, std::size_t y, double depth, const Eigen::Vector4d& normal, int objId);
+    inline void setMiss(std::size_t x, std::size_t y);
+    inline void saveToPfm(std::string basePath);
+
+private:
+    std::size_t          w_{}, h_{};
+    unsigned             mask_{AovNone};
+    std::vector< float > depth_;
+    std::vector< float > normal_;
+    std::vector< float > objId_;
+};
+
+// Writes the enabled outputs of a frame of known size as PFM files one band of rows at a time,
+// like BmpStreamWriter does for the colour pass
+class AovStreamWriter
+{
+public:
+    inline AovStreamWriter(std::string basePath, unsigned mask, std::size_t width, std::size_t height);
+    inline ~AovStreamWriter();
+    AovStreamWriter(const AovStreamWriter&)            = delete;
+    AovStreamWriter& operator=(const AovStreamWriter&) = delete;
+
+    // Row j of band becomes row firstRow + j of the files (row 0 is the bottom one)
+    inline void writeRows(const AovBuffers& band, std::size_t firstRow);
+
+private:
+    struct Output
+    {
+        AovFlags    aov;
+        const char* suffix;
+    };
+    static constexpr std::array< Output, 3 > outputs = {
+        {{AovDepth, ".depth.pfm"}, {AovNormal, ".normal.pfm"}, {AovObjectId, ".id.pfm"}}};
+
+    std::size_t            w_, h_;
+    std::array< FILE*, 3 > files_{};
+    std::array< long, 3 >  headers_{}; // header length of every file
+};
+
+void AovBuffers::resize(std::size_t width, std::size_t height, unsigned mask)
+{
+    if (width == w_ && height == h_ && mask == mask_)
+        return;
+    w_    = width;
+    h_    = height;
+    mask_ = mask;
+    // Disabled outputs keep no storage at all
+    depth_.assign(mask & AovDepth ? w_ * h_ : 0, 0.0f);
+    normal_.assign(mask & AovNormal ? 3 * w_ * h_ : 0, 0.0f);
+    objId_.assign(mask & AovObjectId ? w_ * h_ : 0, 0.0f);
+}
+
+void AovBuffers::setHit(std::size_t x, std::size_t y, double depth, const Eigen::Vector4d& normal, int objId)
+{
+    const std::size_t idx = x + y * w_;
+    if (mask_ & AovDepth)
+        depth_[idx] = static_cast< float >(depth);
+    if (mask_ & AovNormal)
+    {
+        normal_[3 * idx + 0] = static_cast< float >(normal.x());
+        normal_[3 * idx + 1] = static_cast< float >(normal.y());
+        normal_[3 * idx + 2] = static_cast< float >(normal.z());
+    }
+    if (mask_ & AovObjectId)
+        objId_[idx] = static_cast< float >(objId);
+}
+
+void AovBuffers::setMiss(std::size_t x, std::size_t y)
+{
+    const std::size_t idx = x + y * w_;
+    if (mask_ & AovDepth)
+        depth_[idx] = std::numeric_limits< float >::infinity();
+    if (mask_ & AovNormal)
+    {
+        normal_[3 * idx + 0] = 0.0f;
+        normal_[3 * idx + 1] = 0.0f;
+        normal_[3 * idx + 2] = 0.0f;
+    }
+    if (mask_ & AovObjectId)
+        objId_[idx] = -1.0f;
+}
+
+const float* AovBuffers::data(AovFlags aov) const
+{
+    const std::vector< float >& buffer = aov == AovDepth ? depth_ : aov == AovNormal ? normal_ : objId_;
+    return mask_ & aov ? buffer.data() : nullptr;
+}
+
+void AovBuffers::saveToPfm(std::string basePath)
+{
+    AovStreamWriter writer(basePath, mask_, w_, h_);
+    writer.writeRows(*this, 0);
+}
+
+AovStreamWriter::AovStreamWriter(std::string basePath, unsigned mask, std::size_t width, std::size_t height)
+    : w_{width}, h_{height}
+{
+    for (std::size_t k = 0; k < outputs.size(); k++)
+    {
+        if (!(mask & outputs[k].aov))
+            continue;
+        const std::string path = basePath + outputs[k].suffix;
+        files_[k]              = fopen(path.c_str(), "wb");
+        if (!files_[k])
+        {
+            std::cerr << "Can not open " << path << std::endl;
+            continue;
+        }
+        // PFM stores rows bottom-up like BMP, which matches y = 0 being the bottom row here.
+        // Negative scale marks little-endian data.
+        headers_[k] = fprintf(files_[k],
+                              "%s\n%zu %zu\n-1.0\n",
+                              AovBuffers::channels(outputs[k].aov) == 3 ? "PF" : "Pf",
+                              w_,
+                              h_);
+    }
+}
+
+AovStreamWriter::~AovStreamWriter()
+{
+    for (FILE* f : files_)
+        if (f)
+            fclose(f);
+}
+
+void AovStreamWriter::writeRows(const AovBuffers& band, std::size_t firstRow)
+{
+    if (firstRow >= h_)
+        return;
+    const std::size_t rows = std::min(band.getHeight(), h_ - firstRow);
+    for (std::size_t k = 0; k < outputs.size(); k++)
+    {
+        const float* data = band.data(outputs[k].aov);
+        if (!files_[k] || !data)
+            continue;
+        const std::size_t rowFloats = AovBuffers::channels(outputs[k].aov) * w_;
+        fseeko(files_[k], static_cast< off_t >(headers_[k] + firstRow * rowFloats * sizeof(float)), SEEK_SET);
+        fwrite(data, sizeof(float), rows * rowFloats, files_[k]);
+    }
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <tbb/task_arena.h>
+
+#include <atomic>
+#include <cassert>
+#include <coroutine>
+#include <exception>
+#include <future>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+// Handle of work already running on a TBB arena. co_await on it suspends until the work is done
+// and resumes the coroutine on the thread that finished it. Only one coroutine may wait for a job,
+// so the handle is move-only and debug builds assert a second waiter.
+class AsyncJob
+{
+public:
+    AsyncJob()                           = default;
+    AsyncJob(AsyncJob&&)                 = default;
+    AsyncJob& operator=(AsyncJob&&)      = default;
+    AsyncJob(const AsyncJob&)            = delete;
+    AsyncJob& operator=(const AsyncJob&) = delete;
+
+    template< typename Work >
+    static AsyncJob enqueue(tbb::task_arena& arena, Work&& work);
+
+    explicit operator bool() const { return static_cast< bool >(state_); }
+
+    bool await_ready() const noexcept
+    {
+        return !state_ || state_->waiter.load(std::memory_order_acquire) == &State::done;
+    }
+    bool await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        void* expected = nullptr;
+        if (state_->waiter.compare_exchange_strong(expected, awaiting.address(), std::memory_order_acq_rel))
+            return true;
+        // The job finished meanwhile, the coroutine then simply continues
+        assert(expected == &State::done && "AsyncJob supports a single awaiter");
+        return false;
+    }
+    void await_resume() const
+    {
+        if (state_ && state_->error)
+            std::rethrow_exception(state_->error);
+    }
+
+private:
+    struct State
+    {
+        static inline char done;
+        // nullptr while running, the awaiting coroutine once somebody waits, &done when finished
+        std::atomic< void* > waiter{nullptr};
+        std::exception_ptr   error;
+
+        void complete()
+        {
+            void* awaiting = waiter.exchange(&done, std::memory_order_acq_rel);
+            if (awaiting)
+                std::coroutine_handle<>::from_address(awaiting).resume();
+        }
+    };
+
+    std::shared_ptr< State > state_;
+};
+
+template< typename Work >
+AsyncJob AsyncJob::enqueue(tbb::task_arena& arena, Work&& work)
+{
+    AsyncJob job;
+    job.state_ = std::make_shared< State >();
+    arena.enqueue([state = job.state_, work = std::forward< Work >(work)] {
+        try
+        {
+            work();
+        }
+        catch (...)
+        {
+            state->error = std::current_exception();
+        }
+        state->complete();
+    });
+    return job;
+}
+
+template< typename T >
+class Task;
+
+namespace detail
+{
+// Hands the thread over to the awaiting coroutine without growing the stack
+struct ResumeContinuation
+{
+    std::coroutine_handle<> continuation;
+
+    bool                    await_ready() noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<>) noexcept
+    {
+        return continuation ? continuation : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+};
+
+struct TaskPromiseBase
+{
+    std::coroutine_handle<> continuation;
+    std::exception_ptr      error;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    ResumeContinuation  final_suspend() noexcept { return {continuation}; }
+    void                unhandled_exception() { error = std::current_exception(); }
+};
+
+template< typename T >
+struct TaskPromise : TaskPromiseBase
+{
+    std::optional< T > value;
+
+    Task< T > get_return_object();
+    void      return_value(T v) { value = std::move(v); }
+    T         result()
+    {
+        if (error)
+            std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template<>
+struct TaskPromise< void > : TaskPromiseBase
+{
+    Task< void > get_return_object();
+    void         return_void() {}
+    void         result()
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+} // namespace detail
+
+// Lazily started coroutine, runs when awaited and resumes the awaiting coroutine when it returns
+template< typename T = void >
+class Task
+{
+public:
+    using promise_type = detail::TaskPromise< T >;
+
+    explicit Task(std::coroutine_handle< promise_type > handle) : handle_{handle} {}
+    Task(Task&& other) noexcept : handle_{std::exchange(other.handle_, {})} {}
+    Task(const Task&)            = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task()
+    {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    bool                    await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+    T await_resume() { return handle_.promise().result(); }
+
+private:
+    std::coroutine_handle< promise_type > handle_;
+};
+
+namespace detail
+{
+template< typename T >
+Task< T > TaskPromise< T >::get_return_object()
+{
+    return Task< T >{std::coroutine_handle< TaskPromise< T > >::from_promise(*this)};
+}
+
+inline Task< void > TaskPromise< void >::get_return_object()
+{
+    return Task< void >{std::coroutine_handle< TaskPromise< void > >::from_promise(*this)};
+}
+
+// Eagerly started coroutine that destroys itself when done
+struct Detached
+{
+    struct promise_type
+    {
+        Detached           get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void               return_void() {}
+        void               unhandled_exception() { std::terminate(); }
+    };
+};
+} // namespace detail
+
+// Blocks the calling thread until the task is done, for use outside of coroutines
+template< typename T >
+T syncWait(Task< T > task)
+{
+    std::promise< T > result;
+    auto              future = result.get_future();
+    auto              run    = [&]() -> detail::Detached {
+        try
+        {
+            if constexpr (std::is_void_v< T >)
+            {
+                co_await std::move(task);
+                result.set_value();
+            }
+            else
+                result.set_value(co_await std::move(task));
+        }
+        catch (...)
+        {
+            result.set_exception(std::current_exception());
+        }
+    };
+    run();
+    return future.get();
+}
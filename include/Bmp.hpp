@@ -1,76 +1,156 @@
 #pragma once
 
+#include "Schedule.hpp"
 #include "Structs.hpp"
 
+#include <array>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
+#include <iostream>
 #include <memory>
+#include <new>
 #include <string>
 
 class Image
 {
+    // Rows start on a cache line, 64 pixels fill exactly three of them
+    static constexpr std::size_t cacheLine = 64;
+    static constexpr std::size_t rowPixels = 64;
+
+    struct FreeAligned
+    {
+        void operator()(Pixel* p) const { ::operator delete[](p, std::align_val_t{cacheLine}); }
+    };
+
 public:
     inline Image() = default;
-    inline Image(std::size_t width, std::size_t height)
-        : w_{width}, h_{height}, canvas_{std::make_unique_for_overwrite< Pixel[] >(width * height)}
-    {}
+    // Pixels are initialised by the calling thread
+    inline Image(std::size_t width, std::size_t height);
+    // Pixels are initialised by the threads the scheduler hands their rows to, see RowScheduler
+    inline Image(std::size_t width, std::size_t height, RowScheduler& scheduler);
 
-    inline void  setPixel(std::size_t x, std::size_t y, Pixel p);
-    inline Pixel getPixel(std::size_t x, std::size_t y);
-    inline void  saveToBmp(std::string path);
+    inline void        setPixel(std::size_t x, std::size_t y, Pixel p);
+    inline Pixel       getPixel(std::size_t x, std::size_t y) const;
+    inline std::size_t getWidth() const { return w_; }
+    inline std::size_t getHeight() const { return h_; }
+    inline Pixel*      row(std::size_t y) { return canvas_.get() + y * stride_; }
+    // Returns false when the file could not be written
+    inline bool        saveToBmp(std::string path);
 
 private:
-    std::size_t                w_, h_;
-    std::unique_ptr< Pixel[] > canvas_;
+    inline void allocate();
+
+    std::size_t                             w_{}, h_{}, stride_{};
+    std::unique_ptr< Pixel[], FreeAligned > canvas_;
 };
 
-void Image::setPixel(std::size_t x, std::size_t y, Pixel p)
+Image::Image(std::size_t width, std::size_t height) : w_{width}, h_{height}
 {
-    canvas_[x + y * w_] = p;
+    allocate();
+    std::uninitialized_default_construct_n(canvas_.get(), stride_ * h_);
 }
 
-Pixel Image::getPixel(std::size_t x, std::size_t y)
+Image::Image(std::size_t width, std::size_t height, RowScheduler& scheduler) : w_{width}, h_{height}
 {
-    return canvas_[x + y * w_];
+    allocate();
+    scheduler.forEachRows(0, static_cast< int >(h_), [this](tbb::blocked_range< int > r) {
+        std::uninitialized_default_construct_n(row(r.begin()), stride_ * r.size());
+    });
 }
 
-void Image::saveToBmp(std::string path)
+void Image::allocate()
 {
-    // Coordinate system in left down corner, x right, y up
-    FILE*       f;
-    std::size_t filesize = 54 + 3 * w_ * h_; // w_ is your image width, h_ is image height, both std::size_t
+    // Raw storage, pages are only placed once something writes to them
+    stride_ = (w_ + rowPixels - 1) / rowPixels * rowPixels;
+    canvas_.reset(static_cast< Pixel* >(::operator new[](stride_ * h_ * sizeof(Pixel), std::align_val_t{cacheLine})));
+}
 
-    const auto img = std::make_unique_for_overwrite< unsigned char[] >(3 * w_ * h_);
+// Writes a BMP of known size one band of rows at a time, so the full image never has to be in memory
+class BmpStreamWriter
+{
+public:
+    inline BmpStreamWriter(std::string path, std::size_t width, std::size_t height);
+    inline ~BmpStreamWriter();
+    BmpStreamWriter(const BmpStreamWriter&)            = delete;
+    BmpStreamWriter& operator=(const BmpStreamWriter&) = delete;
 
-    for (std::size_t i = 0; i < w_; i++)
-    {
-        for (std::size_t j = 0; j < h_; j++)
-        {
-            const auto x              = i;
-            const auto y              = (h_ - 1) - j;
-            Pixel      p              = getPixel(i, j);
-            img[(x + y * w_) * 3 + 2] = static_cast< unsigned char >(p.r);
-            img[(x + y * w_) * 3 + 1] = static_cast< unsigned char >(p.g);
-            img[(x + y * w_) * 3 + 0] = static_cast< unsigned char >(p.b);
-        }
-    }
+    // Row j of band becomes row firstRow + j of the file (row 0 is the bottom one).
+    // Returns false when the file could not be opened or written.
+    inline bool writeRows(const Image& band, std::size_t firstRow);
+
+private:
+    FILE*                              f_{};
+    std::size_t                        w_, h_, stride_;
+    std::unique_ptr< unsigned char[] > row_;
+};
+
+void Image::setPixel(std::size_t x, std::size_t y, Pixel p)
+{
+    canvas_[x + y * stride_] = p;
+}
+
+Pixel Image::getPixel(std::size_t x, std::size_t y) const
+{
+    return canvas_[x + y * stride_];
+}
+
+bool Image::saveToBmp(std::string path)
+{
+    BmpStreamWriter writer(path, w_, h_);
+    return writer.writeRows(*this, 0);
+}
+
+BmpStreamWriter::BmpStreamWriter(std::string path, std::size_t width, std::size_t height)
+    : w_{width}, h_{height}, stride_{(3 * width + 3) / 4 * 4}, row_{std::make_unique< unsigned char[] >(stride_)}
+{
+    // Coordinate system in left down corner, x right, y up
+    std::uint64_t filesize = 54 + stride_ * h_;
 
     unsigned char bmpfileheader[14] = {'B', 'M', 0, 0, 0, 0, 0, 0, 0, 0, 54, 0, 0, 0};
     unsigned char bmpinfoheader[40] = {40, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 24, 0};
-    unsigned char bmppad[3]         = {0, 0, 0};
 
-    const auto fsz32 = static_cast< std::uint32_t >(filesize);
+    // Readers ignore the size field, leave it empty when it does not fit
+    const auto fsz32 = static_cast< std::uint32_t >(filesize > UINT32_MAX ? 0 : filesize);
     std::memcpy(bmpfileheader + 2, &fsz32, sizeof fsz32);
     const auto info_hdr_arr = std::array{static_cast< std::uint32_t >(w_), static_cast< std::uint32_t >(h_)};
     std::memcpy(bmpinfoheader + 4, info_hdr_arr.data(), sizeof info_hdr_arr);
 
-    f = fopen(path.c_str(), "wb");
-    fwrite(bmpfileheader, 1, 14, f);
-    fwrite(bmpinfoheader, 1, 40, f);
-    for (std::size_t i = 0; i < h_; i++)
+    f_ = fopen(path.c_str(), "wb");
+    if (!f_)
     {
-        fwrite(img.get() + (w_ * (h_ - i - 1) * 3), 3, w_, f);
-        fwrite(bmppad, 1, (4 - (w_ * 3) % 4) % 4, f);
+        std::cerr << "Can not open " << path << std::endl;
+        return;
     }
+    fwrite(bmpfileheader, 1, 14, f_);
+    fwrite(bmpinfoheader, 1, 40, f_);
+}
 
-    fclose(f);
-}
\ No newline at end of file
+BmpStreamWriter::~BmpStreamWriter()
+{
+    if (f_)
+        fclose(f_);
+}
+
+bool BmpStreamWriter::writeRows(const Image& band, std::size_t firstRow)
+{
+    if (!f_)
+        return false;
+    // BMP is stored bottom-up and row 0 is the bottom one, so rows land at increasing offsets
+    if (fseeko(f_, static_cast< off_t >(54 + firstRow * stride_), SEEK_SET) != 0)
+        return false;
+    for (std::size_t j = 0; j < band.getHeight() && firstRow + j < h_; j++)
+    {
+        for (std::size_t i = 0; i < w_; i++)
+        {
+            const Pixel p   = band.getPixel(i, j);
+            row_[i * 3 + 2] = p.r;
+            row_[i * 3 + 1] = p.g;
+            row_[i * 3 + 0] = p.b;
+        }
+        if (fwrite(row_.get(), 1, stride_, f_) != stride_)
+            return false;
+    }
+    // Buffered rows have to reach the file before the caller can rely on it
+    return fflush(f_) == 0;
+}
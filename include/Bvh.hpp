@@ -0,0 +1,192 @@
+#pragma once
+
+#include "Structs.hpp"
+
+#include <Eigen/Dense>
+#include <tbb/tbb.h>
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+struct Aabb
+{
+    Eigen::Array3d lo = Eigen::Array3d::Constant(std::numeric_limits< double >::max());
+    Eigen::Array3d hi = Eigen::Array3d::Constant(-std::numeric_limits< double >::max());
+
+    void grow(const Aabb& other)
+    {
+        lo = lo.min(other.lo);
+        hi = hi.max(other.hi);
+    }
+    double area() const
+    {
+        const Eigen::Array3d d = (hi - lo).max(0.0);
+        return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
+    Eigen::Array3d centroid() const { return (lo + hi) / 2; }
+
+    // Entry distance of the ray, or infinity when it misses the box before tMax
+    double hit(const Eigen::Array3d& origin, const Eigen::Array3d& invDir, double tMax) const
+    {
+        const Eigen::Array3d t0    = (lo - origin) * invDir;
+        const Eigen::Array3d t1    = (hi - origin) * invDir;
+        const double         tNear = std::max(t0.min(t1).maxCoeff(), 0.0);
+        const double         tFar  = std::min(t0.max(t1).minCoeff(), tMax);
+        return tNear <= tFar ? tNear : std::numeric_limits< double >::infinity();
+    }
+};
+
+// Bounding volume hierarchy over a list of primitive boxes.
+// Primitives are referred to by their position in the box list, order() lists them leaf by leaf.
+// After primitives move, refit() recomputes the boxes bottom-up without changing the topology.
+class Bvh
+{
+public:
+    static constexpr int leafSize = 8;
+
+    struct Node
+    {
+        Aabb box;
+        int  left = -1, right = -1; // children, -1 for leaves
+        int  first, count;          // primitives order()[first, first + count)
+    };
+
+    inline void build(const std::vector< Aabb >& boxes);
+    // Returns false when the tree got too loose after the motion and should be rebuilt
+    inline bool refit(const std::vector< Aabb >& boxes, double maxCostGrowth = 2.0);
+
+    bool                      empty() const { return nodes_.empty(); }
+    const std::vector< int >& order() const { return order_; }
+    double                    cost() const { return cost_; }
+
+    // Calls leaf(first, count) for leaves the ray enters before tMax, nearest first.
+    // leaf may lower tMax when it finds a hit.
+    template< typename Leaf >
+    void traverse(const Ray& ray, double& tMax, const Leaf& leaf) const;
+
+private:
+    inline int    buildNode(const std::vector< Aabb >& boxes, int first, int count);
+    inline double refitNode(const std::vector< Aabb >& boxes, int node);
+
+    std::vector< Node > nodes_;
+    std::vector< int >  order_;
+    double              cost_{}, builtCost_{};
+};
+
+void Bvh::build(const std::vector< Aabb >& boxes)
+{
+    nodes_.clear();
+    order_.resize(boxes.size());
+    std::iota(order_.begin(), order_.end(), 0);
+    if (boxes.empty())
+        return;
+    nodes_.reserve(2 * boxes.size() / leafSize + 1);
+    buildNode(boxes, 0, static_cast< int >(boxes.size()));
+    cost_ = builtCost_ = refitNode(boxes, 0) / std::max(nodes_[0].box.area(), 1e-12);
+}
+
+int Bvh::buildNode(const std::vector< Aabb >& boxes, int first, int count)
+{
+    const int node = static_cast< int >(nodes_.size());
+    nodes_.push_back({});
+    nodes_[node].first = first;
+    nodes_[node].count = count;
+    if (count <= leafSize)
+        return node;
+
+    // Median split along the widest spread of centroids
+    Aabb centroids;
+    for (int k = first; k < first + count; k++)
+    {
+        const Eigen::Array3d c = boxes[order_[k]].centroid();
+        centroids.grow({c, c});
+    }
+    Eigen::Index axis;
+    (centroids.hi - centroids.lo).maxCoeff(&axis);
+    const int half = count / 2;
+    std::nth_element(order_.begin() + first,
+                     order_.begin() + first + half,
+                     order_.begin() + first + count,
+                     [&](int a, int b) { return boxes[a].centroid()(axis) < boxes[b].centroid()(axis); });
+
+    const int left     = buildNode(boxes, first, half);
+    const int right    = buildNode(boxes, first + half, count - half);
+    nodes_[node].left  = left;
+    nodes_[node].right = right;
+    return node;
+}
+
+bool Bvh::refit(const std::vector< Aabb >& boxes, double maxCostGrowth)
+{
+    if (nodes_.empty())
+        return true;
+    cost_ = refitNode(boxes, 0) / std::max(nodes_[0].box.area(), 1e-12);
+    return cost_ <= maxCostGrowth * builtCost_;
+}
+
+// Refits the subtree and returns its surface area cost (node areas, leaves weighted by their primitive count)
+double Bvh::refitNode(const std::vector< Aabb >& boxes, int node)
+{
+    Node& n = nodes_[node];
+    if (n.left < 0)
+    {
+        n.box = Aabb{};
+        for (int k = n.first; k < n.first + n.count; k++)
+            n.box.grow(boxes[order_[k]]);
+        return n.box.area() * n.count;
+    }
+
+    double leftCost, rightCost;
+    // Subtrees are disjoint, so large ones are refitted in parallel
+    if (n.count > 64 * leafSize)
+        tbb::parallel_invoke([&] { leftCost = refitNode(boxes, n.left); },
+                             [&] { rightCost = refitNode(boxes, n.right); });
+    else
+    {
+        leftCost  = refitNode(boxes, n.left);
+        rightCost = refitNode(boxes, n.right);
+    }
+    n.box = nodes_[n.left].box;
+    n.box.grow(nodes_[n.right].box);
+    return n.box.area() + leftCost + rightCost;
+}
+
+template< typename Leaf >
+void Bvh::traverse(const Ray& ray, double& tMax, const Leaf& leaf) const
+{
+    if (nodes_.empty())
+        return;
+    const Eigen::Array3d origin = ray.point.head< 3 >().array();
+    const Eigen::Array3d invDir = ray.dir.head< 3 >().array().inverse();
+
+    std::pair< int, double > stack[64];
+    int                      top = 0;
+    stack[top++]                 = {0, nodes_[0].box.hit(origin, invDir, tMax)};
+    while (top > 0)
+    {
+        const auto [node, tNear] = stack[--top];
+        if (tNear > tMax)
+            continue;
+        const Node& n = nodes_[node];
+        if (n.left < 0)
+        {
+            leaf(n.first, n.count);
+            continue;
+        }
+        double tLeft  = nodes_[n.left].box.hit(origin, invDir, tMax);
+        double tRight = nodes_[n.right].box.hit(origin, invDir, tMax);
+        int    near = n.left, far = n.right;
+        if (tRight < tLeft)
+        {
+            std::swap(near, far);
+            std::swap(tLeft, tRight);
+        }
+        // Farther child goes first so the nearer one is popped next
+        if (tRight <= tMax)
+            stack[top++] = {far, tRight};
+        if (tLeft <= tMax)
+            stack[top++] = {near, tLeft};
+    }
+}
@@ -0,0 +1,254 @@
+#pragma once
+
+#include "Bmp.hpp"
+#include "Render.hpp"
+#include "Structs.hpp"
+
+#include <tbb/global_control.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Splits frames into bands of rows and renders them on forked worker processes.
+// Workers are forked once, so each one keeps its own copy of the scene for its whole life,
+// and get a new band as soon as they return the previous one. Scene changes made after the fork,
+// e.g. Render::updateSpheres, are not seen by the workers.
+class TileCoordinator
+{
+public:
+    // Has to be created before the parent process touches TBB, forking a running TBB pool is not safe
+    inline TileCoordinator(Render& render, int workers, int tileRows = 16);
+    inline ~TileCoordinator();
+    TileCoordinator(const TileCoordinator&)            = delete;
+    TileCoordinator& operator=(const TileCoordinator&) = delete;
+
+    // Renders the whole frame into render's framebuffer, which must have been prepared at full height
+    inline void renderImage(RenderMode mode, int batch_size = 8);
+
+private:
+    struct TileRequest
+    {
+        Camera     camera;
+        double     lodThreshold;
+        int        frame;
+        RenderMode mode;
+        int        batch_size;
+        int        width, height;
+        int        rowBegin, rowEnd;
+    };
+
+    struct Worker
+    {
+        pid_t pid;
+        int   fd;               // -1 once the worker died
+        int   rowBegin, rowEnd; // band in flight, rowBegin < 0 when idle
+    };
+
+    inline static bool readAll(int fd, void* buf, std::size_t size);
+    inline static bool writeAll(int fd, const void* buf, std::size_t size);
+    inline static void workerLoop(Render& render, int fd, int threads);
+
+    Render&               render_;
+    int                   tileRows_;
+    int                   frame_{};
+    std::vector< Worker > workers_;
+};
+
+TileCoordinator::TileCoordinator(Render& render, int workers, int tileRows)
+    : render_{render}, tileRows_{std::max(tileRows, 1)}
+{
+    const int threads = std::max(1, static_cast< int >(std::thread::hardware_concurrency()) / std::max(workers, 1));
+    for (int w = 0; w < workers; w++)
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        {
+            perror("socketpair");
+            break;
+        }
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("fork");
+            close(fds[0]);
+            close(fds[1]);
+            break;
+        }
+        if (pid == 0)
+        {
+            close(fds[0]);
+            for (const auto& other : workers_)
+                close(other.fd);
+            workerLoop(render_, fds[1], threads);
+            _exit(0);
+        }
+        close(fds[1]);
+        workers_.push_back({pid, fds[0], -1, -1});
+    }
+}
+
+TileCoordinator::~TileCoordinator()
+{
+    // Workers exit on EOF
+    for (const auto& worker : workers_)
+        if (worker.fd >= 0)
+            close(worker.fd);
+    for (const auto& worker : workers_)
+        waitpid(worker.pid, nullptr, 0);
+}
+
+void TileCoordinator::renderImage(RenderMode mode, int batch_size)
+{
+    const int width  = render_.getWidth();
+    const int height = render_.getHeight();
+    if (std::none_of(workers_.begin(), workers_.end(), [](const Worker& w) { return w.fd >= 0; }))
+    {
+        render_.renderImage(mode, batch_size);
+        return;
+    }
+
+    std::deque< std::pair< int, int > > tiles;
+    for (int row = 0; row < height; row += tileRows_)
+        tiles.emplace_back(row, std::min(row + tileRows_, height));
+
+    TileRequest request{
+        render_.getCamera(), render_.getLodThreshold(), frame_++, mode, batch_size, width, height, -1, -1};
+    auto        dispatch = [&](Worker& worker) {
+        if (tiles.empty() || worker.fd < 0)
+            return;
+        std::tie(worker.rowBegin, worker.rowEnd) = tiles.front();
+        tiles.pop_front();
+        request.rowBegin = worker.rowBegin;
+        request.rowEnd   = worker.rowEnd;
+        if (!writeAll(worker.fd, &request, sizeof request))
+            std::cerr << "Worker " << worker.pid << " is gone" << std::endl;
+    };
+
+    for (auto& worker : workers_)
+        dispatch(worker);
+
+    std::vector< pollfd > pfds(workers_.size());
+    Image&                frame = render_.getImage();
+    while (true)
+    {
+        std::size_t busy = 0;
+        for (std::size_t w = 0; w < workers_.size(); w++)
+        {
+            pfds[w] = {workers_[w].fd, static_cast< short >(workers_[w].rowBegin >= 0 ? POLLIN : 0), 0};
+            busy += workers_[w].rowBegin >= 0;
+        }
+        if (busy == 0)
+            break;
+        if (poll(pfds.data(), pfds.size(), -1) < 0)
+        {
+            perror("poll");
+            return;
+        }
+        for (std::size_t w = 0; w < workers_.size(); w++)
+        {
+            auto& worker = workers_[w];
+            if (worker.rowBegin < 0 || !(pfds[w].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            bool ok = true;
+            for (int row = worker.rowBegin; ok && row < worker.rowEnd; row++)
+                ok = readAll(worker.fd, frame.row(row), width * sizeof(Pixel));
+            if (!ok)
+            {
+                std::cerr << "Worker " << worker.pid << " failed, its rows go to the others" << std::endl;
+                tiles.emplace_back(worker.rowBegin, worker.rowEnd);
+                close(worker.fd);
+                worker.fd       = -1;
+                worker.rowBegin = -1;
+                continue;
+            }
+            worker.rowBegin = -1;
+            dispatch(worker);
+        }
+    }
+
+    // Only reached with tiles left when all workers died
+    if (!tiles.empty())
+    {
+        Image full = std::move(frame);
+        render_.prepare(width, height, tileRows_);
+        render_.updateLod();
+        for (const auto& [rowBegin, rowEnd] : tiles)
+        {
+            render_.renderRows(mode, rowBegin, rowEnd, batch_size);
+            for (int row = rowBegin; row < rowEnd; row++)
+                std::copy_n(render_.getImage().row(row - rowBegin), width, full.row(row));
+        }
+        render_.getImage() = std::move(full);
+    }
+}
+
+void TileCoordinator::workerLoop(Render& render, int fd, int threads)
+{
+    tbb::global_control limit(tbb::global_control::max_allowed_parallelism, threads);
+
+    TileRequest request;
+    int         width = -1, height = -1, rows = -1, frame = -1;
+    while (readAll(fd, &request, sizeof request))
+    {
+        const int tileRows = request.rowEnd - request.rowBegin;
+        if (request.width != width || request.height != height || tileRows > rows)
+        {
+            width  = request.width;
+            height = request.height;
+            rows   = std::max(tileRows, rows);
+            render.prepare(width, height, rows);
+        }
+        render.getCamera() = request.camera;
+        if (request.frame != frame)
+        {
+            frame = request.frame;
+            render.setLodThreshold(request.lodThreshold);
+            render.updateLod();
+        }
+        render.renderRows(request.mode, request.rowBegin, request.rowEnd, request.batch_size);
+        bool ok = true;
+        for (int row = 0; ok && row < tileRows; row++)
+            ok = writeAll(fd, render.getImage().row(row), width * sizeof(Pixel));
+        if (!ok)
+            break;
+    }
+    close(fd);
+}
+
+bool TileCoordinator::readAll(int fd, void* buf, std::size_t size)
+{
+    auto* p = static_cast< char* >(buf);
+    while (size > 0)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= static_cast< std::size_t >(n);
+    }
+    return true;
+}
+
+bool TileCoordinator::writeAll(int fd, const void* buf, std::size_t size)
+{
+    auto* p = static_cast< const char* >(buf);
+    while (size > 0)
+    {
+        // A dead peer must not take the process down with SIGPIPE
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= static_cast< std::size_t >(n);
+    }
+    return true;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "Obj.hpp"
+#include "Structs.hpp"
+
+#include <Eigen/Dense>
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Appends the faces of a Wavefront OBJ file to objs as Triangles, polygons are split into fans.
+// Only vertex positions are read; texture coordinates, normals, groups and materials are ignored.
+// Vertices are scaled and then moved by offset. Returns the number of triangles added, -1 when the file fails.
+inline long loadObjMesh(const std::string&     path,
+                        const Color&           color,
+                        std::vector< Obj3D* >& objs,
+                        double                 scale  = 1.0,
+                        const Eigen::Vector4d& offset = Eigen::Vector4d::Zero())
+{
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f)
+    {
+        std::cerr << "Can not open mesh " << path << std::endl;
+        return -1;
+    }
+
+    std::vector< Eigen::Vector4d > vertices;
+    std::vector< long >            face;
+    long                           added  = 0;
+    long                           lineNo = 0;
+    char*                          line   = nullptr;
+    std::size_t                    cap    = 0;
+    while (getline(&line, &cap, f) > 0)
+    {
+        lineNo++;
+        const char* p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            char*           end;
+            Eigen::Vector4d v = offset;
+            v(3)              = 1.0;
+            p++;
+            for (int axis = 0; axis < 3; axis++, p = end)
+                v(axis) += scale * std::strtod(p, &end);
+            vertices.push_back(v);
+        }
+        else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            // Indices are 1-based, negative ones count back from the last vertex, "v/vt/vn" keeps v
+            face.clear();
+            p++;
+            char* end;
+            for (long idx = std::strtol(p, &end, 10); end != p; idx = std::strtol(p, &end, 10))
+            {
+                face.push_back(idx < 0 ? static_cast< long >(vertices.size()) + idx : idx - 1);
+                p = end;
+                while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+                    p++;
+            }
+            bool valid = face.size() >= 3;
+            for (long idx : face)
+                valid &= idx >= 0 && idx < static_cast< long >(vertices.size());
+            if (!valid)
+            {
+                std::cerr << path << ":" << lineNo << ": invalid face" << std::endl;
+                continue;
+            }
+            for (std::size_t k = 1; k + 1 < face.size(); k++)
+            {
+                objs.push_back(new Triangle(vertices[face[0]], vertices[face[k]], vertices[face[k + 1]], color));
+                added++;
+            }
+        }
+    }
+    free(line);
+    fclose(f);
+    return added;
+}
@@ -3,12 +3,17 @@
 #include "Structs.hpp"
 
 #include <Eigen/Dense>
+
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <limits>
 #include <optional>
 
 class Obj3D
 {
 public:
+    virtual ~Obj3D() = default;
     virtual std::pair< double, std::optional< Eigen::Vector4d > > intersection(Ray ray)               = 0;
     virtual Eigen::Vector4d                                       normalVector(Eigen::Vector4d point) = 0;
     virtual Color                                                 getColor(Eigen::Vector4d point)     = 0;
@@ -25,6 +30,8 @@ public:
     inline Color getColor(Eigen::Vector4d point) override { return color_; };
     inline Eigen::Vector4d getCenter() {return center_;}
     inline double getRadius() {return radius_;}
+    inline void setCenter(const Eigen::Vector4d& center) {center_ = center;}
+    inline void setRadius(double radius) {radius_ = radius;}
 
 private:
     Eigen::Vector4d center_;
@@ -69,8 +76,6 @@ public:
     inline Color                                                 getColor(Eigen::Vector4d point) override;
 
 private:
-    Eigen::Vector4d center_;
-    double          radius_;
     Color           color[2] = {Color(252, 204, 116), Color(87, 58, 46)};
 };
 
@@ -87,7 +92,8 @@ std::pair< double, std::optional< Eigen::Vector4d > > Plane::intersection(Ray ra
     Eigen::Vector4d intersectionPoint = p + scale * v;
     if(intersectionPoint.maxCoeff() > mapSize || intersectionPoint.minCoeff() < -mapSize)
         return std::make_pair(-1.0, std::nullopt);
-    return std::make_pair(scale * p.z(), intersectionPoint);
+    // dir is normalized, so scale is the distance along the ray like for every other object
+    return std::make_pair(scale, intersectionPoint);
 }
 
 Eigen::Vector4d Plane::normalVector(Eigen::Vector4d point)
@@ -102,4 +108,157 @@ Color Plane::getColor(Eigen::Vector4d point)
     int           y     = static_cast< int >(point.y());
     int           res   = (x >= 0 ? x : x - scale) / scale + (y > 0 ? y : y - scale) / scale;
     return res % 2 == 0 ? color[0] : color[1];
-};
\ No newline at end of file
+};
+
+// Both sides of the triangle can be hit
+class Triangle : public Obj3D
+{
+public:
+    Triangle(const Eigen::Vector4d& a, const Eigen::Vector4d& b, const Eigen::Vector4d& c, const Color& color)
+        : a_{a}, e1_{b - a}, e2_{c - a}, normal_{e1_.cross3(e2_).normalized()}, color_{color}
+    {}
+    inline std::pair< double, std::optional< Eigen::Vector4d > > intersection(Ray ray) override;
+    inline Eigen::Vector4d normalVector(Eigen::Vector4d point) override { return normal_; }
+    inline Color           getColor(Eigen::Vector4d point) override { return color_; }
+    inline Eigen::Vector4d getVertex() const { return a_; }
+    inline Eigen::Vector4d getEdge1() const { return e1_; }
+    inline Eigen::Vector4d getEdge2() const { return e2_; }
+
+private:
+    Eigen::Vector4d a_, e1_, e2_;
+    Eigen::Vector4d normal_;
+    Color           color_;
+};
+
+// Moller-Trumbore, the same arithmetic as batchTriangleIntersection
+std::pair< double, std::optional< Eigen::Vector4d > > Triangle::intersection(Ray ray)
+{
+    const Eigen::Vector4d p   = ray.dir.cross3(e2_);
+    const double          det = e1_.dot(p);
+    if (std::abs(det) < 1e-12)
+        return std::make_pair(-1.0, std::nullopt);
+    const Eigen::Vector4d t = ray.point - a_;
+    const Eigen::Vector4d q = t.cross3(e1_);
+    const double          u = t.dot(p) / det;
+    const double          v = ray.dir.dot(q) / det;
+    const double          s = e2_.dot(q) / det;
+    if (u < 0.0 || v < 0.0 || u + v > 1.0 || s < 0.0)
+        return std::make_pair(-1.0, std::nullopt);
+    return std::make_pair(s, ray.point + s * ray.dir);
+}
+
+// Axis-aligned box
+class Box : public Obj3D
+{
+public:
+    Box(const Eigen::Vector4d& lo, const Eigen::Vector4d& hi, const Color& color) : lo_{lo}, hi_{hi}, color_{color} {}
+    inline std::pair< double, std::optional< Eigen::Vector4d > > intersection(Ray ray) override;
+    inline Eigen::Vector4d                                       normalVector(Eigen::Vector4d point) override;
+    inline Color           getColor(Eigen::Vector4d point) override { return color_; }
+    inline Eigen::Vector4d getLo() const { return lo_; }
+    inline Eigen::Vector4d getHi() const { return hi_; }
+
+private:
+    Eigen::Vector4d lo_, hi_;
+    Color           color_;
+};
+
+std::pair< double, std::optional< Eigen::Vector4d > > Box::intersection(Ray ray)
+{
+    const Eigen::Array3d invDir = ray.dir.head< 3 >().array().inverse();
+    const Eigen::Array3d t0     = (lo_.head< 3 >() - ray.point.head< 3 >()).array() * invDir;
+    const Eigen::Array3d t1     = (hi_.head< 3 >() - ray.point.head< 3 >()).array() * invDir;
+    const double         tNear  = t0.min(t1).maxCoeff();
+    const double         tFar   = t0.max(t1).minCoeff();
+    // Like spheres, boxes around the ray origin are missed
+    if (tNear < 0.0 || tNear > tFar)
+        return std::make_pair(-1.0, std::nullopt);
+    return std::make_pair(tNear, ray.point + tNear * ray.dir);
+}
+
+Eigen::Vector4d Box::normalVector(Eigen::Vector4d point)
+{
+    // Normal of the face the point lies closest to
+    const Eigen::Array3d toLo = (point - lo_).head< 3 >().array().abs();
+    const Eigen::Array3d toHi = (point - hi_).head< 3 >().array().abs();
+    Eigen::Index         loAxis, hiAxis;
+    const double         loDist = toLo.minCoeff(&loAxis);
+    const double         hiDist = toHi.minCoeff(&hiAxis);
+    Eigen::Vector4d      normal = Eigen::Vector4d::Zero();
+    if (loDist < hiDist)
+        normal(loAxis) = -1.0;
+    else
+        normal(hiAxis) = 1.0;
+    return normal;
+}
+
+// Capped cylinder standing on base along the unit axis
+class Cylinder : public Obj3D
+{
+public:
+    Cylinder(const Eigen::Vector4d& base, const Eigen::Vector4d& axis, double radius, double height, const Color& color)
+        : base_{base}, axis_{axis.normalized()}, radius_{radius}, height_{height}, color_{color}
+    {}
+    inline std::pair< double, std::optional< Eigen::Vector4d > > intersection(Ray ray) override;
+    inline Eigen::Vector4d                                       normalVector(Eigen::Vector4d point) override;
+    inline Color           getColor(Eigen::Vector4d point) override { return color_; }
+    inline Eigen::Vector4d getBase() const { return base_; }
+    inline Eigen::Vector4d getAxis() const { return axis_; }
+    inline double          getRadius() const { return radius_; }
+    inline double          getHeight() const { return height_; }
+
+private:
+    Eigen::Vector4d base_, axis_;
+    double          radius_, height_;
+    Color           color_;
+};
+
+// Same arithmetic as batchCylinderIntersection
+std::pair< double, std::optional< Eigen::Vector4d > > Cylinder::intersection(Ray ray)
+{
+    const Eigen::Vector4d w     = ray.point - base_;
+    const double          wa    = w.dot(axis_);
+    const double          da    = ray.dir.dot(axis_);
+    const Eigen::Vector4d dp    = ray.dir - da * axis_;
+    const Eigen::Vector4d wp    = w - wa * axis_;
+    const double          a     = dp.squaredNorm();
+    const double          b     = 2 * dp.dot(wp);
+    const double          wp2   = wp.squaredNorm();
+    const double          delta = b * b - 4 * a * (wp2 - radius_ * radius_);
+
+    double s = std::numeric_limits< double >::max();
+    // Side, only between the caps
+    if (delta >= 0.0)
+    {
+        const double delta_sqrt = std::sqrt(delta);
+        for (double side : {(-b - delta_sqrt) / (2 * a), (-b + delta_sqrt) / (2 * a)})
+        {
+            const double h = wa + side * da;
+            if (side >= 0.0 && h >= 0.0 && h <= height_)
+            {
+                s = std::min(s, side);
+                break;
+            }
+        }
+    }
+    // Caps, only inside the radius
+    for (double cap : {-wa / da, (height_ - wa) / da})
+        if (cap >= 0.0 && a * cap * cap + b * cap + wp2 <= radius_ * radius_)
+            s = std::min(s, cap);
+
+    if (s == std::numeric_limits< double >::max())
+        return std::make_pair(-1.0, std::nullopt);
+    return std::make_pair(s, ray.point + s * ray.dir);
+}
+
+Eigen::Vector4d Cylinder::normalVector(Eigen::Vector4d point)
+{
+    const Eigen::Vector4d w = point - base_;
+    const double          h = w.dot(axis_);
+    const Eigen::Vector4d radial = w - h * axis_;
+    // Points on the rim count to the cap they are closer to than to the side
+    const double toSide = std::abs(radial.norm() - radius_);
+    if (std::min(h, height_ - h) < toSide)
+        return h < height_ / 2 ? Eigen::Vector4d(-axis_) : axis_;
+    return radial.normalized();
+}
@@ -0,0 +1,299 @@
+#pragma once
+
+#include "Bvh.hpp"
+#include "Obj.hpp"
+#include "Structs.hpp"
+
+#include <Eigen/Dense>
+#include <tbb/tbb.h>
+
+#include <limits>
+#include <vector>
+
+// Struct-of-arrays layouts of the primitives besides spheres. Every layout stores one primitive per row of an
+// Eigen::Array< double, Dynamic, fields >, so each field is contiguous, and provides a batched kernel that
+// returns the hit distance of every row of a batch, std::numeric_limits< double >::max() for misses.
+
+struct TriangleSoa
+{
+    using Object                = Triangle;
+    static constexpr int fields = 9; // vertex, edge1, edge2
+
+    template< int batch_size >
+    using Batch = Eigen::Array< double, batch_size, fields >;
+
+    static Aabb bounds(const Triangle& t)
+    {
+        const Eigen::Array3d a = t.getVertex().head< 3 >().array();
+        const Eigen::Array3d b = a + t.getEdge1().head< 3 >().array();
+        const Eigen::Array3d c = a + t.getEdge2().head< 3 >().array();
+        return {a.min(b).min(c), a.max(b).max(c)};
+    }
+    static Eigen::Array< double, 1, fields > store(const Triangle& t)
+    {
+        Eigen::Array< double, 1, fields > row;
+        row << t.getVertex().head< 3 >().transpose(), t.getEdge1().head< 3 >().transpose(),
+            t.getEdge2().head< 3 >().transpose();
+        return row;
+    }
+    // Degenerate triangles are never hit
+    static Eigen::Array< double, 1, fields > unhittable() { return Eigen::Array< double, 1, fields >::Zero(); }
+
+    template< int batch_size >
+    static Eigen::Array< double, batch_size, 1 > intersect(const Ray& ray, const Batch< batch_size >& tri);
+};
+
+struct BoxSoa
+{
+    using Object                = Box;
+    static constexpr int fields = 6; // lo, hi
+
+    template< int batch_size >
+    using Batch = Eigen::Array< double, batch_size, fields >;
+
+    static Aabb bounds(const Box& b) { return {b.getLo().head< 3 >().array(), b.getHi().head< 3 >().array()}; }
+    static Eigen::Array< double, 1, fields > store(const Box& b)
+    {
+        Eigen::Array< double, 1, fields > row;
+        row << b.getLo().head< 3 >().transpose(), b.getHi().head< 3 >().transpose();
+        return row;
+    }
+    // Inside out boxes are never hit
+    static Eigen::Array< double, 1, fields > unhittable()
+    {
+        Eigen::Array< double, 1, fields > row;
+        row << 1, 1, 1, 0, 0, 0;
+        return row;
+    }
+
+    template< int batch_size >
+    static Eigen::Array< double, batch_size, 1 > intersect(const Ray& ray, const Batch< batch_size >& box);
+};
+
+struct CylinderSoa
+{
+    using Object                = Cylinder;
+    static constexpr int fields = 8; // base, axis, radius2, height
+
+    template< int batch_size >
+    using Batch = Eigen::Array< double, batch_size, fields >;
+
+    static Aabb bounds(const Cylinder& c)
+    {
+        const Eigen::Array3d base = c.getBase().head< 3 >().array();
+        const Eigen::Array3d axis = c.getAxis().head< 3 >().array();
+        const Eigen::Array3d top  = base + c.getHeight() * axis;
+        // Extent of the cap discs along every coordinate axis
+        const Eigen::Array3d disc = c.getRadius() * (1.0 - axis.square()).max(0.0).sqrt();
+        return {base.min(top) - disc, base.max(top) + disc};
+    }
+    static Eigen::Array< double, 1, fields > store(const Cylinder& c)
+    {
+        Eigen::Array< double, 1, fields > row;
+        row << c.getBase().head< 3 >().transpose(), c.getAxis().head< 3 >().transpose(),
+            c.getRadius() * c.getRadius(), c.getHeight();
+        return row;
+    }
+    // Infinite negative radius2 makes every side and cap test fail
+    static Eigen::Array< double, 1, fields > unhittable()
+    {
+        Eigen::Array< double, 1, fields > row;
+        row << 0, 0, 0, 0, 0, 1, -std::numeric_limits< double >::infinity(), 0;
+        return row;
+    }
+
+    template< int batch_size >
+    static Eigen::Array< double, batch_size, 1 > intersect(const Ray& ray, const Batch< batch_size >& cyl);
+};
+
+// Moller-Trumbore on batch_size triangles at once, both sides are hit
+template< int batch_size >
+Eigen::Array< double, batch_size, 1 > TriangleSoa::intersect(const Ray& ray, const Batch< batch_size >& tri)
+{
+    using Column = Eigen::Array< double, batch_size, 1 >;
+    const Eigen::Vector4d& o = ray.point;
+    const Eigen::Vector4d& d = ray.dir;
+
+    // p = dir x edge2
+    const Column px  = d.y() * tri.col(8) - d.z() * tri.col(7);
+    const Column py  = d.z() * tri.col(6) - d.x() * tri.col(8);
+    const Column pz  = d.x() * tri.col(7) - d.y() * tri.col(6);
+    const Column det = tri.col(3) * px + tri.col(4) * py + tri.col(5) * pz;
+
+    const Column tx = o.x() - tri.col(0);
+    const Column ty = o.y() - tri.col(1);
+    const Column tz = o.z() - tri.col(2);
+    const Column u  = (tx * px + ty * py + tz * pz) / det;
+    // q = t x edge1
+    const Column qx = ty * tri.col(5) - tz * tri.col(4);
+    const Column qy = tz * tri.col(3) - tx * tri.col(5);
+    const Column qz = tx * tri.col(4) - ty * tri.col(3);
+    const Column v  = (d.x() * qx + d.y() * qy + d.z() * qz) / det;
+    const Column s  = (tri.col(6) * qx + tri.col(7) * qy + tri.col(8) * qz) / det;
+
+    const auto hit = det.abs() >= 1e-12 && u >= 0.0 && v >= 0.0 && u + v <= 1.0 && s >= 0.0;
+    return hit.select(s, std::numeric_limits< double >::max());
+}
+
+// Slab test on batch_size boxes at once, like spheres boxes around the ray origin are missed
+template< int batch_size >
+Eigen::Array< double, batch_size, 1 > BoxSoa::intersect(const Ray& ray, const Batch< batch_size >& box)
+{
+    using Column = Eigen::Array< double, batch_size, 1 >;
+    Column tNear = Column::Constant(-std::numeric_limits< double >::max());
+    Column tFar  = Column::Constant(std::numeric_limits< double >::max());
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const double invDir = 1.0 / ray.dir(axis);
+        const Column t0     = (box.col(axis) - ray.point(axis)) * invDir;
+        const Column t1     = (box.col(axis + 3) - ray.point(axis)) * invDir;
+        tNear               = tNear.max(t0.min(t1));
+        tFar                = tFar.min(t0.max(t1));
+    }
+    const auto hit = tNear >= 0.0 && tNear <= tFar && box.col(0) <= box.col(3);
+    return hit.select(tNear, std::numeric_limits< double >::max());
+}
+
+// Capped cylinders, the side is a quadratic in the plane orthogonal to the axis like batchIntersection
+template< int batch_size >
+Eigen::Array< double, batch_size, 1 > CylinderSoa::intersect(const Ray& ray, const Batch< batch_size >& cyl)
+{
+    using Column = Eigen::Array< double, batch_size, 1 >;
+    const Eigen::Vector4d& o       = ray.point;
+    const Eigen::Vector4d& d       = ray.dir;
+    const auto             radius2 = cyl.col(6);
+    const auto             height  = cyl.col(7);
+    constexpr double       miss    = std::numeric_limits< double >::max();
+
+    const Column wx = o.x() - cyl.col(0);
+    const Column wy = o.y() - cyl.col(1);
+    const Column wz = o.z() - cyl.col(2);
+    const Column wa = wx * cyl.col(3) + wy * cyl.col(4) + wz * cyl.col(5);
+    const Column da = d.x() * cyl.col(3) + d.y() * cyl.col(4) + d.z() * cyl.col(5);
+    // Ray origin and direction without their components along the axis
+    const Column dpx = d.x() - da * cyl.col(3);
+    const Column dpy = d.y() - da * cyl.col(4);
+    const Column dpz = d.z() - da * cyl.col(5);
+    const Column wpx = wx - wa * cyl.col(3);
+    const Column wpy = wy - wa * cyl.col(4);
+    const Column wpz = wz - wa * cyl.col(5);
+
+    const Column a     = dpx * dpx + dpy * dpy + dpz * dpz;
+    const Column b     = 2 * (dpx * wpx + dpy * wpy + dpz * wpz);
+    const Column wp2   = wpx * wpx + wpy * wpy + wpz * wpz;
+    const Column delta = b * b - 4 * a * (wp2 - radius2);
+
+    const Column delta_sqrt = delta.abs().sqrt();
+    const Column s1         = (-b - delta_sqrt) / (2 * a);
+    const Column s2         = (-b + delta_sqrt) / (2 * a);
+    const Column h1         = wa + s1 * da;
+    const Column h2         = wa + s2 * da;
+    const auto   side1      = delta >= 0.0 && s1 >= 0.0 && h1 >= 0.0 && h1 <= height;
+    const auto   side2      = delta >= 0.0 && s2 >= 0.0 && h2 >= 0.0 && h2 <= height;
+    Column       s          = side1.select(s1, side2.select(s2, miss));
+
+    const Column bottom = -wa / da;
+    const Column top    = (height - wa) / da;
+    s = s.min((bottom >= 0.0 && a * bottom * bottom + b * bottom + wp2 <= radius2).select(bottom, miss));
+    s = s.min((top >= 0.0 && a * top * top + b * top + wp2 <= radius2).select(top, miss));
+    return s;
+}
+
+// One primitive type under its own BVH, laid out leaf by leaf in the Soa layout
+template< typename Soa >
+class PrimitiveSet
+{
+public:
+    using Object = typename Soa::Object;
+
+    // Collects the objects of type Object, builds their BVH and the layout. The layout is padded with primitives no
+    // ray can hit to a multiple of batchMultiple rows, at least Bvh::leafSize past the last primitive.
+    inline void build(Obj3D** objs, std::size_t noOfObjs, int batchMultiple);
+
+    bool empty() const { return primitives_ == 0; }
+    // Object index of every row, -1 for padding
+    const std::vector< int >& objects() const { return objIndex_; }
+
+    // Lowers tMax and sets nearest and point when a primitive is hit before tMax
+    inline void traverse(const Ray& ray, double& tMax, int& nearest, Eigen::Vector4d& point) const;
+    // Same without the BVH, tests all rows batch_size at a time
+    template< int batch_size >
+    void scan(const Ray& ray, double& tMax, int& nearest, Eigen::Vector4d& point) const;
+
+private:
+    template< int batch_size >
+    void nearestIn(const Ray& ray, Eigen::Index first, double& tMax, int& nearest, Eigen::Vector4d& point) const;
+
+    Bvh                                                   bvh_;
+    std::size_t                                           primitives_{};
+    Eigen::Array< double, Eigen::Dynamic, Soa::fields >   data_;
+    std::vector< int >                                    objIndex_;
+};
+
+template< typename Soa >
+void PrimitiveSet< Soa >::build(Obj3D** objs, std::size_t noOfObjs, int batchMultiple)
+{
+    std::vector< int > slots; // object index of every primitive in objs order
+    for (std::size_t k = 0; k < noOfObjs; k++)
+        if (dynamic_cast< Object* >(objs[k]))
+            slots.push_back(static_cast< int >(k));
+    primitives_ = slots.size();
+
+    std::vector< Aabb > boxes(slots.size());
+    tbb::parallel_for(tbb::blocked_range< std::size_t >(0, slots.size()), [&](tbb::blocked_range< std::size_t > r) {
+        for (std::size_t i = r.begin(); i < r.end(); ++i)
+            boxes[i] = Soa::bounds(*static_cast< Object* >(objs[slots[i]]));
+    });
+    bvh_.build(boxes);
+
+    const auto&        order = bvh_.order();
+    const Eigen::Index rows  = slots.empty() ? 0
+                                             : (slots.size() + Bvh::leafSize + batchMultiple - 1) / batchMultiple *
+                                                  batchMultiple;
+    data_.resize(rows, Soa::fields);
+    objIndex_.assign(rows, -1);
+    tbb::parallel_for(tbb::blocked_range< Eigen::Index >(0, rows), [&](tbb::blocked_range< Eigen::Index > r) {
+        for (Eigen::Index row = r.begin(); row < r.end(); ++row)
+        {
+            if (row < static_cast< Eigen::Index >(order.size()))
+            {
+                objIndex_[row] = slots[order[row]];
+                data_.row(row) = Soa::store(*static_cast< Object* >(objs[objIndex_[row]]));
+            }
+            else
+                data_.row(row) = Soa::unhittable();
+        }
+    });
+}
+
+template< typename Soa >
+void PrimitiveSet< Soa >::traverse(const Ray& ray, double& tMax, int& nearest, Eigen::Vector4d& point) const
+{
+    // Leaves read Bvh::leafSize rows from their first one, the padding keeps the last leaf in bounds
+    bvh_.traverse(ray, tMax, [&](int first, int) { nearestIn< Bvh::leafSize >(ray, first, tMax, nearest, point); });
+}
+
+template< typename Soa >
+template< int batch_size >
+void PrimitiveSet< Soa >::scan(const Ray& ray, double& tMax, int& nearest, Eigen::Vector4d& point) const
+{
+    for (Eigen::Index first = 0; first < data_.rows(); first += batch_size)
+        nearestIn< batch_size >(ray, first, tMax, nearest, point);
+}
+
+template< typename Soa >
+template< int batch_size >
+void PrimitiveSet< Soa >::nearestIn(
+    const Ray& ray, Eigen::Index first, double& tMax, int& nearest, Eigen::Vector4d& point) const
+{
+    const typename Soa::template Batch< batch_size > batch = data_.template middleRows< batch_size >(first);
+    const Eigen::Array< double, batch_size, 1 >      s     = Soa::template intersect< batch_size >(ray, batch);
+    Eigen::Index                                     minIndex;
+    const double                                     min = s.minCoeff(&minIndex);
+    if (min < tMax)
+    {
+        tMax    = min;
+        nearest = objIndex_[first + minIndex];
+        point   = ray.point + min * ray.dir;
+    }
+}
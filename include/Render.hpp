@@ -1,27 +1,46 @@
 #pragma once
 
+#include "Async.hpp"
+#include "Aov.hpp"
 #include "Bmp.hpp"
+#include "Bvh.hpp"
 #include "Obj.hpp"
+#include "Primitives.hpp"
+#include "Schedule.hpp"
 #include "Structs.hpp"
 
 #include <Eigen/Dense>
 #include <tbb/tbb.h>
 
+#include <algorithm>
+#include <cassert>
 #include <iostream>
 #include <limits>
 #include <numbers>
+#include <optional>
+#include <span>
 #include <string>
 #include <vector>
 #include <tuple>
 #include <chrono>
 
-constexpr int sphereNo = 1024;
+// Sphere matrices are padded to a multiple of the largest SIMD batch
+constexpr int maxBatchSize = 128;
 
 enum struct RenderMode
 {
     CPU,
     TBB,
-    SIMD
+    SIMD,
+    BVH
+};
+
+// New placement of the sphere objs[index]
+struct SphereUpdate
+{
+    std::size_t     index;
+    Eigen::Vector4d center;
+    double          radius;
 };
 
 class Render
@@ -34,9 +53,37 @@ class Render
 public:
     Render(Camera& cam, std::vector< Light >& lights, Obj3D** objects, size_t noOfObjects)
         : camera{cam}, objs{objects}, lights{lights}, noOfObjs{noOfObjects} {}
-    void prepare(int width, int height);
+    // bandRows > 0 keeps only that many rows in memory, the frame then has to go through renderToBmp
+    void prepare(int width, int height, int bandRows = 0);
     void renderImage(RenderMode mode, int batch_size = 8);
-    void saveTo(std::string path) {img.saveToBmp(path);}
+    // Renders rows [rowBegin, rowEnd) into the framebuffer starting from its row 0
+    void renderRows(RenderMode mode, int rowBegin, int rowEnd, int batch_size = 8);
+    // Renders band by band and writes each band to the file as soon as it is done. AOVs of banded frames
+    // are written the same way to aovBasePath.*.pfm, full frames keep them in memory for saveAovTo as well.
+    void renderToBmp(RenderMode mode, std::string path, int batch_size = 8, std::string aovBasePath = "");
+    // Returns false when the file could not be written
+    bool saveTo(std::string path) { return img.saveToBmp(path); }
+    // Start right away on the TBB pool, co_await the result to resume once done. Only one renderAsync may
+    // be in flight per Render; saveAsync copies the frame before returning, so the next render can overlap it.
+    AsyncJob renderAsync(const Camera& cam, RenderMode mode, int batch_size = 8);
+    AsyncJob saveAsync(std::string path);
+    // Mask of AovFlags captured by the next renderImage call, AovNone disables them
+    void setAovMask(unsigned mask) { aovMask = mask; }
+    void saveAovTo(std::string basePath) { aov.saveToPfm(basePath); }
+    // Spheres projecting to fewer pixels than this are splatted instead of ray traced, 0 disables LOD
+    void   setLodThreshold(double pixels) { lodThreshold = pixels; }
+    double getLodThreshold() const { return lodThreshold; }
+    // Picks the objects the kernels test for the current camera, renderImage and renderToBmp call it per frame
+    void updateLod();
+    // Moves spheres in bulk (indices must be in range and unique, debug builds assert it) and refits the BVH,
+    // rebuilding it once the refitted tree costs more than maxBvhCostGrowth times the freshly built one
+    void updateSpheres(std::span< const SphereUpdate > updates);
+    void setMaxBvhCostGrowth(double growth) { maxBvhCostGrowth = growth; }
+
+    Camera& getCamera() { return camera; }
+    Image&  getImage() { return img; }
+    int     getWidth() const { return width; }
+    int     getHeight() const { return height; }
 
 private:
     inline static double myCos(Eigen::Vector4d a, Eigen::Vector4d b, bool cut = true);
@@ -46,84 +93,371 @@ private:
     //                                std::vector< Light >& lights);
     inline static Color
     calcColor(Eigen::Vector4d sectionPoint, Eigen::Vector4d cameraPos, Obj3D* Obj, std::vector< Light >& lights);
-    void renderImageCPU();
-    void renderImageTBB();
-
-    template<int noOfSpheres, int batch_size>
-    void renderImageSIMDSpheres();
+    void renderImageCPU(int rowBegin, int rowEnd);
+    void renderImageTBB(int rowBegin, int rowEnd);
+    void renderImageBVH(int rowBegin, int rowEnd);
+    void buildBvh();
+    void layoutBvh();
+    inline static Aabb sphereBox(Sphere* sphere);
+
+    template<int batch_size>
+    void renderImageSIMDSpheres(int rowBegin, int rowEnd);
+    inline void
+    seedFromSplat(int i, int j, const Ray& ray, double& z_buffor, int& nearestObjIndex, Eigen::Vector4d& sectionPoint);
 
     Camera&               camera;
     Obj3D**               objs;
     const size_t                noOfObjs;
     std::vector< Light >& lights;
+    RowScheduler scheduler;
+    tbb::task_arena asyncArena;
     Image img;
+    AovBuffers aov;
+    unsigned aovMask = AovNone;
     int width, height;
 
     const Color skyColor = {135, 206, 235};
-    Eigen::Matrix<double,4,sphereNo> centers;
-    Eigen::Vector<double,sphereNo> radius2;
-
+    Eigen::Matrix<double,4,Eigen::Dynamic> centers;
+    Eigen::VectorXd radius2;
+    std::vector< int > sphereIndex; // object index of every column of centers
+
+    // Objects the CPU and TBB kernels test, the rest is splatted or culled
+    std::vector< int > activeObjs;
+    double lodThreshold = 0.0;
+    // Nearest splatted sphere of every covered pixel, sorted by pixel. A sphere covers at most its projected
+    // disc of lodThreshold pixels across, so the memory follows the scene and not the frame size
+    struct Splat
+    {
+        std::size_t pixel;
+        float       depth;
+        int         obj;
+    };
+    std::vector< Splat > splats;
+
+    // BVH over all spheres, slots number the spheres in objs order
+    bool bvhBuilt = false;
+    Bvh bvh;
+    double maxBvhCostGrowth = 2.0;
+    std::vector< int > bvhSpheres; // object index of every slot
+    std::vector< int > sphereSlot; // slot of every object, -1 for other objects
+    std::vector< Aabb > sphereBoxes;
+    // Leaf-ordered SIMD copy of the spheres, column c holds slot bvh.order()[c]
+    Eigen::Matrix<double,4,Eigen::Dynamic> bvhCenters;
+    Eigen::VectorXd bvhRadius2;
+    std::vector< int > bvhColumn; // column of every slot
+    // Other bounded primitives, each type under its own BVH
+    PrimitiveSet< TriangleSoa > triangles;
+    PrimitiveSet< BoxSoa > boxes;
+    PrimitiveSet< CylinderSoa > cylinders;
+    std::vector< int > otherObjs; // objects in none of the BVHs, tested one by one
 };
 
-template<int noOfSpheres>
-std::tuple<Eigen::Matrix<double,4,noOfSpheres>,Eigen::Vector<double,noOfSpheres>> prepareSpheresMatrix(Obj3D **objs)
+// Spheres of objs listed in indices as SIMD matrices, padded with spheres no ray can hit
+inline std::tuple<Eigen::Matrix<double,4,Eigen::Dynamic>,Eigen::VectorXd> prepareSpheresMatrix(Obj3D **objs, const std::vector< int >& indices)
 {
-    Eigen::Matrix<double,4,noOfSpheres> centers;
-    Eigen::Vector<double,noOfSpheres> radius2;
-    for (size_t i = 0; i < noOfSpheres; i++)
+    const Eigen::Index cols = (indices.size() + maxBatchSize - 1) / maxBatchSize * maxBatchSize;
+    Eigen::Matrix<double,4,Eigen::Dynamic> centers = Eigen::Matrix<double,4,Eigen::Dynamic>::Zero(4, cols);
+    // Infinite negative radius2 makes delta negative for every ray
+    Eigen::VectorXd radius2 = Eigen::VectorXd::Constant(cols, -std::numeric_limits< double >::infinity());
+    for (size_t i = 0; i < indices.size(); i++)
     {
-        radius2(i) = std::pow((dynamic_cast<Sphere*>(objs[i]))->getRadius(),2);
-        centers.col(i) = dynamic_cast<Sphere*>(objs[i])->getCenter();
+        radius2(i) = std::pow((dynamic_cast<Sphere*>(objs[indices[i]]))->getRadius(),2);
+        centers.col(i) = dynamic_cast<Sphere*>(objs[indices[i]])->getCenter();
     }
     return {centers,radius2};
 }
 
-void Render::prepare(int width_, int height_)
+void Render::prepare(int width_, int height_, int bandRows)
 {
     width = width_;
     height = height_;
-    img = std::move(Image(width, height));
-    std::tie(centers, radius2) = prepareSpheresMatrix<sphereNo>(objs);
+    img = std::move(Image(width, bandRows > 0 ? std::min(bandRows, height) : height, scheduler));
+}
+
+void Render::updateLod()
+{
+    activeObjs.clear();
+    sphereIndex.clear();
+    splats.clear();
+
+    Eigen::Vector4d screenUp, screenRight;
+    Eigen::Vector4d centralRay = camera.screenCenter - camera.pos;
+    screenRight                = centralRay.cross3(camera.up).normalized();
+    screenUp                   = screenRight.cross3(centralRay).normalized();
+    double fov                 = camera.fov * (std::numbers::pi / 180);
+    double step                = std::tan(fov / 2) * centralRay.norm() / (width / 2);
+    double screenDist          = centralRay.norm();
+    Eigen::Vector4d forward    = centralRay / screenDist;
+
+    if (!bvhBuilt)
+        buildBvh();
+
+    for (size_t k = 0; k < noOfObjs; k++)
+    {
+        if (sphereSlot[k] < 0)
+        {
+            activeObjs.push_back(k);
+            continue;
+        }
+        auto* sphere = static_cast<Sphere*>(objs[k]);
+        double radius = sphere->getRadius();
+        bool   traced = true;
+        if (lodThreshold > 0.0)
+        {
+            Eigen::Vector4d toCenter = sphere->getCenter() - camera.pos;
+            double          depth    = toCenter.dot(forward);
+            // Entirely behind the camera
+            if (depth < -radius)
+                traced = false;
+            // Projected diameter in pixels, spheres around the camera plane are always traced
+            else if (depth > radius && 2 * radius * screenDist / depth / step < lodThreshold)
+            {
+                traced = false;
+                // The projected disc covers the pixels whose centres it contains and at least the one under
+                // its centre. Depths follow the sphere's front, so shading and depth sorting stay close to tracing.
+                Eigen::Vector4d onScreen   = camera.pos + toCenter * (screenDist / depth) - camera.screenCenter;
+                const double    ci         = onScreen.dot(screenRight) / step + width / 2;
+                const double    cj         = onScreen.dot(screenUp) / step + height / 2;
+                const double    r          = radius * screenDist / depth / step;
+                const double    centerDist = toCenter.norm();
+                const long      centerI    = std::lround(ci);
+                const long      centerJ    = std::lround(cj);
+                const long      jEnd       = std::min< long >(height - 1, std::lround(std::ceil(cj + r)));
+                const long      iEnd       = std::min< long >(width - 1, std::lround(std::ceil(ci + r)));
+                for (long j = std::max< long >(0, std::lround(std::floor(cj - r))); j <= jEnd; j++)
+                    for (long i = std::max< long >(0, std::lround(std::floor(ci - r))); i <= iEnd; i++)
+                    {
+                        const double q2 = ((i - ci) * (i - ci) + (j - cj) * (j - cj)) / (r * r);
+                        if (q2 > 1.0 && (i != centerI || j != centerJ))
+                            continue;
+                        const float dist =
+                            static_cast< float >(centerDist - radius * std::sqrt(std::max(0.0, 1.0 - q2)));
+                        splats.push_back(
+                            {static_cast< std::size_t >(j) * width + i, dist, static_cast< int >(k)});
+                    }
+            }
+        }
+        // Spheres left out of this frame stay in the BVH but can not be hit
+        bvhRadius2(bvhColumn[sphereSlot[k]]) = traced ? radius * radius : -std::numeric_limits< double >::infinity();
+        if (traced)
+        {
+            activeObjs.push_back(k);
+            sphereIndex.push_back(k);
+        }
+    }
+    std::tie(centers, radius2) = prepareSpheresMatrix(objs, sphereIndex);
+
+    // Keep the nearest splat per pixel, the first sphere on ties
+    std::sort(splats.begin(), splats.end(), [](const Splat& a, const Splat& b) {
+        return std::tie(a.pixel, a.depth, a.obj) < std::tie(b.pixel, b.depth, b.obj);
+    });
+    splats.erase(std::unique(splats.begin(),
+                             splats.end(),
+                             [](const Splat& a, const Splat& b) { return a.pixel == b.pixel; }),
+                 splats.end());
+}
+
+Aabb Render::sphereBox(Sphere* sphere)
+{
+    const Eigen::Array3d center = sphere->getCenter().head< 3 >().array();
+    return {center - sphere->getRadius(), center + sphere->getRadius()};
+}
+
+void Render::buildBvh()
+{
+    bvhSpheres.clear();
+    sphereBoxes.clear();
+    sphereSlot.assign(noOfObjs, -1);
+    for (size_t k = 0; k < noOfObjs; k++)
+        if (auto* sphere = dynamic_cast<Sphere*>(objs[k]))
+        {
+            sphereSlot[k] = static_cast< int >(bvhSpheres.size());
+            bvhSpheres.push_back(k);
+            sphereBoxes.push_back(sphereBox(sphere));
+        }
+    bvh.build(sphereBoxes);
+    layoutBvh();
+
+    triangles.build(objs, noOfObjs, maxBatchSize);
+    boxes.build(objs, noOfObjs, maxBatchSize);
+    cylinders.build(objs, noOfObjs, maxBatchSize);
+    std::vector< bool > inBvh(noOfObjs);
+    for (size_t k = 0; k < noOfObjs; k++)
+        inBvh[k] = sphereSlot[k] >= 0;
+    for (const auto* objects : {&triangles.objects(), &boxes.objects(), &cylinders.objects()})
+        for (int k : *objects)
+            if (k >= 0)
+                inBvh[k] = true;
+    otherObjs.clear();
+    for (size_t k = 0; k < noOfObjs; k++)
+        if (!inBvh[k])
+            otherObjs.push_back(k);
+    bvhBuilt = true;
+}
+
+void Render::layoutBvh()
+{
+    const auto& order = bvh.order();
+    // Leaves read Bvh::leafSize columns from their first one, the padding keeps the last leaf in bounds
+    bvhCenters = Eigen::Matrix<double,4,Eigen::Dynamic>::Zero(4, order.size() + Bvh::leafSize);
+    bvhRadius2 = Eigen::VectorXd::Constant(order.size() + Bvh::leafSize, -std::numeric_limits< double >::infinity());
+    bvhColumn.resize(order.size());
+    for (size_t c = 0; c < order.size(); c++)
+    {
+        auto* sphere        = static_cast<Sphere*>(objs[bvhSpheres[order[c]]]);
+        bvhColumn[order[c]] = c;
+        bvhCenters.col(c)   = sphere->getCenter();
+        bvhRadius2(c)       = std::pow(sphere->getRadius(), 2);
+    }
+}
+
+void Render::updateSpheres(std::span< const SphereUpdate > updates)
+{
+    if (!bvhBuilt)
+        buildBvh();
+
+#ifndef NDEBUG
+    // The parallel loop below writes every index without locking
+    std::vector< bool > updated(noOfObjs);
+    for (const auto& update : updates)
+    {
+        assert(update.index < noOfObjs && "SphereUpdate index out of range");
+        assert(!updated[update.index] && "SphereUpdate indices must not repeat");
+        updated[update.index] = true;
+    }
+#endif
+
+    tbb::parallel_for(tbb::blocked_range< size_t >(0, updates.size()), [&](tbb::blocked_range< size_t > r) {
+        for (size_t u = r.begin(); u < r.end(); ++u)
+        {
+            auto* sphere = dynamic_cast<Sphere*>(objs[updates[u].index]);
+            if (!sphere)
+                continue;
+            sphere->setCenter(updates[u].center);
+            sphere->setRadius(updates[u].radius);
+            const int slot                  = sphereSlot[updates[u].index];
+            sphereBoxes[slot]               = sphereBox(sphere);
+            bvhCenters.col(bvhColumn[slot]) = sphere->getCenter();
+            bvhRadius2(bvhColumn[slot])     = std::pow(sphere->getRadius(), 2);
+        }
+    });
+
+    if (!bvh.refit(sphereBoxes, maxBvhCostGrowth))
+    {
+        bvh.build(sphereBoxes);
+        layoutBvh();
+    }
+}
+
+void Render::seedFromSplat(
+    int i, int j, const Ray& ray, double& z_buffor, int& nearestObjIndex, Eigen::Vector4d& sectionPoint)
+{
+    // A splatted sphere covers its pixel at the depth of its front, ray traced objects still win when closer
+    const std::size_t idx   = static_cast< std::size_t >(j) * width + i;
+    auto              splat = std::lower_bound(
+        splats.begin(), splats.end(), idx, [](const Splat& s, std::size_t pixel) { return s.pixel < pixel; });
+    if (splat == splats.end() || splat->pixel != idx)
+        return;
+    z_buffor        = splat->depth;
+    nearestObjIndex = splat->obj;
+    sectionPoint    = ray.point + z_buffor * ray.dir;
 }
 
 void Render::renderImage(RenderMode mode, int batch_size)
+{
+    if (static_cast< int >(img.getHeight()) < height)
+    {
+        std::cerr << "Framebuffer holds a band only, use renderToBmp" << std::endl;
+        return;
+    }
+    aov.resize(width, height, aovMask);
+    updateLod();
+    renderRows(mode, 0, height, batch_size);
+}
+
+void Render::renderToBmp(RenderMode mode, std::string path, int batch_size, std::string aovBasePath)
+{
+    const int bandRows = static_cast< int >(img.getHeight());
+    unsigned  mask     = aovMask;
+    if (mask && bandRows < height && aovBasePath.empty())
+    {
+        std::cerr << "AOVs of a banded frame need a path to stream to, they are not rendered" << std::endl;
+        mask = AovNone;
+    }
+    aov.resize(width, bandRows, mask);
+    updateLod();
+
+    BmpStreamWriter                  writer(path, width, height);
+    std::optional< AovStreamWriter > aovWriter;
+    if (mask && !aovBasePath.empty())
+        aovWriter.emplace(aovBasePath, mask, width, height);
+    for (int row = 0; row < height; row += bandRows)
+    {
+        renderRows(mode, row, std::min(row + bandRows, height), batch_size);
+        writer.writeRows(img, row);
+        if (aovWriter)
+            aovWriter->writeRows(aov, row);
+    }
+}
+
+AsyncJob Render::renderAsync(const Camera& cam, RenderMode mode, int batch_size)
+{
+    return AsyncJob::enqueue(asyncArena, [this, cam, mode, batch_size] {
+        camera = cam;
+        renderImage(mode, batch_size);
+    });
+}
+
+AsyncJob Render::saveAsync(std::string path)
+{
+    auto frame = std::make_shared< Image >(img.getWidth(), img.getHeight(), scheduler);
+    for (std::size_t row = 0; row < img.getHeight(); row++)
+        std::copy_n(img.row(row), img.getWidth(), frame->row(row));
+    return AsyncJob::enqueue(asyncArena, [frame, path] { frame->saveToBmp(path); });
+}
+
+void Render::renderRows(RenderMode mode, int rowBegin, int rowEnd, int batch_size)
 {
     switch (mode)
     {
     case RenderMode::CPU:
-        renderImageCPU();
+        renderImageCPU(rowBegin, rowEnd);
         break;
 
     case RenderMode::TBB:
-        renderImageTBB();
+        renderImageTBB(rowBegin, rowEnd);
+        break;
+
+    case RenderMode::BVH:
+        renderImageBVH(rowBegin, rowEnd);
         break;
 
     case RenderMode::SIMD:
         switch (batch_size)
         {
         case 1:
-            renderImageSIMDSpheres<sphereNo,1>();
+            renderImageSIMDSpheres<1>(rowBegin, rowEnd);
             break;
         case 2:
-            renderImageSIMDSpheres<sphereNo,2>();
+            renderImageSIMDSpheres<2>(rowBegin, rowEnd);
             break;
         case 4:
-            renderImageSIMDSpheres<sphereNo,4>();
+            renderImageSIMDSpheres<4>(rowBegin, rowEnd);
             break;
         case 8:
-            renderImageSIMDSpheres<sphereNo,8>();
+            renderImageSIMDSpheres<8>(rowBegin, rowEnd);
             break;
         case 16:
-            renderImageSIMDSpheres<sphereNo,16>();
+            renderImageSIMDSpheres<16>(rowBegin, rowEnd);
             break;
         case 32:
-            renderImageSIMDSpheres<sphereNo,32>();
+            renderImageSIMDSpheres<32>(rowBegin, rowEnd);
             break;
         case 64:
-            renderImageSIMDSpheres<sphereNo,64>();
+            renderImageSIMDSpheres<64>(rowBegin, rowEnd);
             break;
         case 128:
-            renderImageSIMDSpheres<sphereNo,128>();
+            renderImageSIMDSpheres<128>(rowBegin, rowEnd);
             break;
         default:
             std::cerr << "Invalid batch size" << std::endl;
@@ -184,7 +518,7 @@ Color Render::calcColor(Eigen::Vector4d       sectionPoint,
     return c;
 }
 
-void Render::renderImageCPU()
+void Render::renderImageCPU(int rowBegin, int rowEnd)
 {
     Eigen::Vector4d screenUp, screenRight;
     Eigen::Vector4d centralRay = camera.screenCenter - camera.pos;
@@ -195,7 +529,7 @@ void Render::renderImageCPU()
 
     //auto t_start = std::chrono::high_resolution_clock::now();
     for (int i = 0; i < width; i++)
-        for (int j = 0; j < height; j++)
+        for (int j = rowBegin; j < rowEnd; j++)
         {
             int             x             = i - width / 2;
             int             y             = j - height / 2;
@@ -205,7 +539,9 @@ void Render::renderImageCPU()
             double          z_buffor        = std::numeric_limits< double >::max();
             int             nearestObjIndex = -1;
             Eigen::Vector4d sectionPoint;
-            for (size_t i = 0; i < noOfObjs; i++)
+            if (!splats.empty())
+                seedFromSplat(i, j, ray, z_buffor, nearestObjIndex, sectionPoint);
+            for (int i : activeObjs)
             {
                 auto res = (objs[i])->intersection(ray);
                 if (res.second.has_value())
@@ -221,11 +557,19 @@ void Render::renderImageCPU()
             if (nearestObjIndex >= 0)
             {
                 Color c = calcColor(sectionPoint, camera.pos, objs[nearestObjIndex], lights);
-                img.setPixel(i, j, Pixel(c));
+                img.setPixel(i, j - rowBegin, Pixel(c));
+                if (aov.getMask())
+                    aov.setHit(i,
+                               j - rowBegin,
+                               z_buffor,
+                               objs[nearestObjIndex]->normalVector(sectionPoint),
+                               nearestObjIndex);
             }
             else
             {
-                img.setPixel(i, j, skyColor);
+                img.setPixel(i, j - rowBegin, skyColor);
+                if (aov.getMask())
+                    aov.setMiss(i, j - rowBegin);
             }
         }
     //auto t_end = std::chrono::high_resolution_clock::now();
@@ -234,7 +578,7 @@ void Render::renderImageCPU()
     //img.saveToBmp(path);
 }
 
-void Render::renderImageTBB()
+void Render::renderImageTBB(int rowBegin, int rowEnd)
 {
     Eigen::Vector4d screenUp, screenRight;
     Eigen::Vector4d centralRay = camera.screenCenter - camera.pos;
@@ -244,43 +588,52 @@ void Render::renderImageTBB()
     double step                = std::tan(fov / 2) * centralRay.norm() / (width / 2);
 
     //auto t_start = std::chrono::high_resolution_clock::now();
-    tbb::parallel_for(tbb::blocked_range< int >(0, width), [&](tbb::blocked_range< int > r) {
-        for (int i = r.begin(); i < r.end(); ++i)
-            tbb::parallel_for(tbb::blocked_range< int >(0, height), [&](tbb::blocked_range< int > r2) {
-                for (int j = r2.begin(); j < r2.end(); ++j)
+    // Tasks own whole framebuffer rows, so no two threads write to the same cache line
+    scheduler.forEachRows(0, rowEnd - rowBegin, [&](tbb::blocked_range< int > r) {
+        for (int j = rowBegin + r.begin(); j < rowBegin + r.end(); ++j)
+            for (int i = 0; i < width; ++i)
+            {
+                int             x             = i - width / 2;
+                int             y             = j - height / 2;
+                Eigen::Vector4d pointOnScreen = camera.screenCenter + x * step * screenRight + y * step * screenUp;
+                Ray             ray(camera.pos, (pointOnScreen - camera.pos).normalized());
+
+                double          z_buffor        = std::numeric_limits< double >::max();
+                int             nearestObjIndex = -1;
+                Eigen::Vector4d sectionPoint;
+                if (!splats.empty())
+                    seedFromSplat(i, j, ray, z_buffor, nearestObjIndex, sectionPoint);
+                for (int i : activeObjs)
                 {
-                    int             x             = i - width / 2;
-                    int             y             = j - height / 2;
-                    Eigen::Vector4d pointOnScreen = camera.screenCenter + x * step * screenRight + y * step * screenUp;
-                    Ray             ray(camera.pos, (pointOnScreen - camera.pos).normalized());
-
-                    double          z_buffor        = std::numeric_limits< double >::max();
-                    int             nearestObjIndex = -1;
-                    Eigen::Vector4d sectionPoint;
-                    for (size_t i = 0; i < noOfObjs; i++)
+                    auto res = (objs[i])->intersection(ray);
+                    if (res.second.has_value())
                     {
-                        auto res = (objs[i])->intersection(ray);
-                        if (res.second.has_value())
+                        if (res.first < z_buffor)
                         {
-                            if (res.first < z_buffor)
-                            {
-                                z_buffor        = res.first;
-                                nearestObjIndex = i;
-                                sectionPoint    = res.second.value();
-                            }
+                            z_buffor        = res.first;
+                            nearestObjIndex = i;
+                            sectionPoint    = res.second.value();
                         }
                     }
-                    if (nearestObjIndex >= 0)
-                    {
-                        Color c = calcColor(sectionPoint, camera.pos, objs[nearestObjIndex], lights);
-                        img.setPixel(i, j, Pixel(c));
-                    }
-                    else
-                    {
-                        img.setPixel(i, j, skyColor);
-                    }
                 }
-            });
+                if (nearestObjIndex >= 0)
+                {
+                    Color c = calcColor(sectionPoint, camera.pos, objs[nearestObjIndex], lights);
+                    img.setPixel(i, j - rowBegin, Pixel(c));
+                    if (aov.getMask())
+                        aov.setHit(i,
+                                   j - rowBegin,
+                                   z_buffor,
+                                   objs[nearestObjIndex]->normalVector(sectionPoint),
+                                   nearestObjIndex);
+                }
+                else
+                {
+                    img.setPixel(i, j - rowBegin, skyColor);
+                    if (aov.getMask())
+                        aov.setMiss(i, j - rowBegin);
+                }
+            }
     });
     //auto t_end = std::chrono::high_resolution_clock::now();
     //std::cout << "Time TBB: " << std::chrono::duration<double, std::milli>(t_end-t_start).count() << "ms" << std::endl;
@@ -316,6 +669,8 @@ inline std::tuple< double, std::optional< Eigen::Vector4d >, int> batchIntersect
     Eigen::Vector<double,batch_size> s1 = (-b - delta_sqrt) / (2* a_scalar);
     Eigen::Vector<double,batch_size> s2 = (-b + delta_sqrt) / (2* a_scalar);
     Eigen::Vector<double,batch_size> s = s1.cwiseMin(s2);
+    // Like Sphere::intersection, spheres starting behind the ray origin are missed
+    s = (s.array() < 0.0).select(inf, s);
     s = s.cwiseMax(mask);
 
     Eigen::Index minIndex;
@@ -323,8 +678,8 @@ inline std::tuple< double, std::optional< Eigen::Vector4d >, int> batchIntersect
     return {min, ray.point + s(minIndex) * ray.dir,minIndex};
 }
 
-template<int noOfSpheres, int batch_size>
-void Render::renderImageSIMDSpheres()
+template<int batch_size>
+void Render::renderImageSIMDSpheres(int rowBegin, int rowEnd)
 {
     Eigen::Vector4d screenUp, screenRight;
     Eigen::Vector4d centralRay = camera.screenCenter - camera.pos;
@@ -335,50 +690,141 @@ void Render::renderImageSIMDSpheres()
 
     // Eigen::Matrix<double,4,noOfSpheres> centers;
     // Eigen::Vector<double,noOfSpheres> radius2;
-    // auto && [centers, radius2] = prepareSpheresMatrix<noOfSpheres>(objs);
+    // auto && [centers, radius2] = prepareSpheresMatrix(objs, sphereIndex);
 
     //auto t_start = std::chrono::high_resolution_clock::now();
-    tbb::parallel_for(tbb::blocked_range< int >(0, width), [&](tbb::blocked_range< int > r) {
-        for (int i = r.begin(); i < r.end(); ++i)
-            tbb::parallel_for(tbb::blocked_range< int >(0, height), [&](tbb::blocked_range< int > r2) {
-                for (int j = r2.begin(); j < r2.end(); ++j)
+    // Tasks own whole framebuffer rows, so no two threads write to the same cache line
+    scheduler.forEachRows(0, rowEnd - rowBegin, [&](tbb::blocked_range< int > r) {
+        for (int j = rowBegin + r.begin(); j < rowBegin + r.end(); ++j)
+            for (int i = 0; i < width; ++i)
+            {
+                int             x             = i - width / 2;
+                int             y             = j - height / 2;
+                Eigen::Vector4d pointOnScreen = camera.screenCenter + x * step * screenRight + y * step * screenUp;
+                Ray             ray(camera.pos, (pointOnScreen - camera.pos).normalized());
+                double          z_buffor        = std::numeric_limits< double >::max();
+                int             nearestObjIndex = -1;
+                Eigen::Vector4d sectionPoint;
+                if (!splats.empty())
+                    seedFromSplat(i, j, ray, z_buffor, nearestObjIndex, sectionPoint);
+                // BATCH SPLITING BEGIN
+                for (int k = 0; k < centers.cols()/batch_size; k++)
                 {
-                    int             x             = i - width / 2;
-                    int             y             = j - height / 2;
-                    Eigen::Vector4d pointOnScreen = camera.screenCenter + x * step * screenRight + y * step * screenUp;
-                    Ray             ray(camera.pos, (pointOnScreen - camera.pos).normalized());
-                    double          z_buffor        = std::numeric_limits< double >::max();
-                    int             nearestObjIndex = -1;
-                    Eigen::Vector4d sectionPoint;
-                    // BATCH SPLITING BEGIN
-                    for (int k = 0; k < noOfSpheres/batch_size; k++)
-                    {
-                        Eigen::Matrix<double,4,batch_size> local_centers = centers.block(0,k*batch_size,4,batch_size);
-                        Eigen::Vector<double,batch_size> local_radius2 = radius2.segment(k*batch_size,batch_size);
-                        auto res = batchIntersection(ray,local_centers,local_radius2);
-                        //std::cout << std::to_string(std::get<0>(res)) + "\n";
-                        if (std::get<0>(res) < z_buffor)
-                        {
-                            z_buffor        = std::get<0>(res);
-                            nearestObjIndex = batch_size * k + std::get<2>(res);
-                            sectionPoint    = std::get<1>(res).value();
-                        }
-                    } 
-                    // BATCH SPLITING END
-                    if (nearestObjIndex >= 0)
+                    Eigen::Matrix<double,4,batch_size> local_centers = centers.block(0,k*batch_size,4,batch_size);
+                    Eigen::Vector<double,batch_size> local_radius2 = radius2.segment(k*batch_size,batch_size);
+                    auto res = batchIntersection(ray,local_centers,local_radius2);
+                    //std::cout << std::to_string(std::get<0>(res)) + "\n";
+                    if (std::get<0>(res) < z_buffor)
                     {
-                        Color c = calcColor(sectionPoint, camera.pos, objs[nearestObjIndex], lights);
-                        img.setPixel(i, j, Pixel(c));
+                        z_buffor        = std::get<0>(res);
+                        nearestObjIndex = sphereIndex[batch_size * k + std::get<2>(res)];
+                        sectionPoint    = std::get<1>(res).value();
                     }
-                    else
+                } 
+                // BATCH SPLITING END
+                triangles.scan< batch_size >(ray, z_buffor, nearestObjIndex, sectionPoint);
+                boxes.scan< batch_size >(ray, z_buffor, nearestObjIndex, sectionPoint);
+                cylinders.scan< batch_size >(ray, z_buffor, nearestObjIndex, sectionPoint);
+                for (int k : otherObjs)
+                {
+                    auto res = (objs[k])->intersection(ray);
+                    if (res.second.has_value() && res.first < z_buffor)
                     {
-                        img.setPixel(i, j, skyColor);
+                        z_buffor        = res.first;
+                        nearestObjIndex = k;
+                        sectionPoint    = res.second.value();
                     }
                 }
-            });
+                if (nearestObjIndex >= 0)
+                {
+                    Color c = calcColor(sectionPoint, camera.pos, objs[nearestObjIndex], lights);
+                    img.setPixel(i, j - rowBegin, Pixel(c));
+                    if (aov.getMask())
+                        aov.setHit(i,
+                                   j - rowBegin,
+                                   z_buffor,
+                                   objs[nearestObjIndex]->normalVector(sectionPoint),
+                                   nearestObjIndex);
+                }
+                else
+                {
+                    img.setPixel(i, j - rowBegin, skyColor);
+                    if (aov.getMask())
+                        aov.setMiss(i, j - rowBegin);
+                }
+            }
     });
     //auto t_end = std::chrono::high_resolution_clock::now();
     //std::cout << "Time SIMD: " << std::chrono::duration<double, std::milli>(t_end-t_start).count() << "ms" << std::endl;
 
     //img.saveToBmp(path);
 }
+
+void Render::renderImageBVH(int rowBegin, int rowEnd)
+{
+    Eigen::Vector4d screenUp, screenRight;
+    Eigen::Vector4d centralRay = camera.screenCenter - camera.pos;
+    screenRight                = centralRay.cross3(camera.up).normalized();
+    screenUp                   = screenRight.cross3(centralRay).normalized();
+    double fov                 = camera.fov * (std::numbers::pi / 180);
+    double step                = std::tan(fov / 2) * centralRay.norm() / (width / 2);
+
+    const auto& order = bvh.order();
+    // Tasks own whole framebuffer rows, so no two threads write to the same cache line
+    scheduler.forEachRows(0, rowEnd - rowBegin, [&](tbb::blocked_range< int > r) {
+        for (int j = rowBegin + r.begin(); j < rowBegin + r.end(); ++j)
+            for (int i = 0; i < width; ++i)
+            {
+                int             x             = i - width / 2;
+                int             y             = j - height / 2;
+                Eigen::Vector4d pointOnScreen = camera.screenCenter + x * step * screenRight + y * step * screenUp;
+                Ray             ray(camera.pos, (pointOnScreen - camera.pos).normalized());
+                double          z_buffor        = std::numeric_limits< double >::max();
+                int             nearestObjIndex = -1;
+                Eigen::Vector4d sectionPoint;
+                if (!splats.empty())
+                    seedFromSplat(i, j, ray, z_buffor, nearestObjIndex, sectionPoint);
+                bvh.traverse(ray, z_buffor, [&](int first, int) {
+                    Eigen::Matrix<double,4,Bvh::leafSize> local_centers = bvhCenters.block<4,Bvh::leafSize>(0,first);
+                    Eigen::Vector<double,Bvh::leafSize> local_radius2 = bvhRadius2.segment<Bvh::leafSize>(first);
+                    auto res = batchIntersection(ray,local_centers,local_radius2);
+                    if (std::get<0>(res) < z_buffor)
+                    {
+                        z_buffor        = std::get<0>(res);
+                        nearestObjIndex = bvhSpheres[order[first + std::get<2>(res)]];
+                        sectionPoint    = std::get<1>(res).value();
+                    }
+                });
+                triangles.traverse(ray, z_buffor, nearestObjIndex, sectionPoint);
+                boxes.traverse(ray, z_buffor, nearestObjIndex, sectionPoint);
+                cylinders.traverse(ray, z_buffor, nearestObjIndex, sectionPoint);
+                for (int k : otherObjs)
+                {
+                    auto res = (objs[k])->intersection(ray);
+                    if (res.second.has_value() && res.first < z_buffor)
+                    {
+                        z_buffor        = res.first;
+                        nearestObjIndex = k;
+                        sectionPoint    = res.second.value();
+                    }
+                }
+                if (nearestObjIndex >= 0)
+                {
+                    Color c = calcColor(sectionPoint, camera.pos, objs[nearestObjIndex], lights);
+                    img.setPixel(i, j - rowBegin, Pixel(c));
+                    if (aov.getMask())
+                        aov.setHit(i,
+                                   j - rowBegin,
+                                   z_buffor,
+                                   objs[nearestObjIndex]->normalVector(sectionPoint),
+                                   nearestObjIndex);
+                }
+                else
+                {
+                    img.setPixel(i, j - rowBegin, skyColor);
+                    if (aov.getMask())
+                        aov.setMiss(i, j - rowBegin);
+                }
+            }
+    });
+}
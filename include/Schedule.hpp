@@ -0,0 +1,58 @@
+#pragma once
+
+#include <tbb/tbb.h>
+
+#include <memory>
+#include <vector>
+
+// Hands out image rows to TBB workers the same way every time it is asked.
+// Rows are split into one contiguous chunk per NUMA node, each chunk runs in an arena pinned to its node,
+// and the affinity partitioners replay the previous thread assignment for the same range. Touching the
+// framebuffer through it first places every page on the node of the thread that later renders into it.
+class RowScheduler
+{
+public:
+    inline RowScheduler();
+
+    // Calls body(tbb::blocked_range< int >) in parallel for rows [rowBegin, rowEnd)
+    template< typename Body >
+    void forEachRows(int rowBegin, int rowEnd, const Body& body);
+
+private:
+    std::vector< std::unique_ptr< tbb::task_arena > >           arenas_;
+    std::vector< std::unique_ptr< tbb::affinity_partitioner > > partitioners_;
+};
+
+RowScheduler::RowScheduler()
+{
+    // Without hwloc support this is a single node with id -1, i.e. one unconstrained arena
+    for (auto node : tbb::info::numa_nodes())
+    {
+        arenas_.push_back(std::make_unique< tbb::task_arena >(tbb::task_arena::constraints(node)));
+        partitioners_.push_back(std::make_unique< tbb::affinity_partitioner >());
+    }
+}
+
+template< typename Body >
+void RowScheduler::forEachRows(int rowBegin, int rowEnd, const Body& body)
+{
+    const int nodes = static_cast< int >(arenas_.size());
+    const int rows  = rowEnd - rowBegin;
+    auto      run   = [&](int node) {
+        const int begin = rowBegin + rows * node / nodes;
+        const int end   = rowBegin + rows * (node + 1) / nodes;
+        tbb::parallel_for(tbb::blocked_range< int >(begin, end), body, *partitioners_[node]);
+    };
+
+    if (nodes == 1)
+    {
+        arenas_[0]->execute([&] { run(0); });
+        return;
+    }
+
+    std::vector< tbb::task_group > groups(nodes);
+    for (int node = 0; node < nodes; node++)
+        arenas_[node]->execute([&, node] { groups[node].run([&, node] { run(node); }); });
+    for (int node = 0; node < nodes; node++)
+        arenas_[node]->execute([&, node] { groups[node].wait(); });
+}
@@ -0,0 +1,371 @@
+#pragma once
+
+#include "Render.hpp"
+#include "Structs.hpp"
+
+#include <tbb/concurrent_queue.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <optional>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+struct RenderRequest
+{
+    std::string id;
+    Camera      camera;
+    int         width, height;
+    std::string path;
+    RenderMode  mode;
+    int         batch_size;
+
+    std::chrono::steady_clock::time_point received;
+};
+
+// Keeps one Render, with its scene, BVH and TBB arenas, alive across requests.
+// Requests are single-line JSON objects such as
+//   {"id": "a", "pos": [-100, -100, 30], "screen": [-90, -90, 25], "width": 640, "height": 480, "path": "a.bmp"}
+// with optional "up", "fov", "mode" (cpu, tbb, simd, bvh) and "batch"; missing fields keep the server defaults.
+// Every request is answered with one JSON line holding its queue, render and total latency, or with
+// {"id": ..., "error": ...} when it fails. The id is left out when the line did not parse far enough to have one.
+class RenderServer
+{
+public:
+    inline RenderServer(Render& render, const RenderRequest& defaults) : render_{render}, defaults_{defaults} {}
+
+    // Serves requests read from in until EOF, answers go to out
+    inline void serve(FILE* in, FILE* out);
+    // Serves the connections of a Unix socket one after another, never returns unless the socket fails
+    inline void serveSocket(const std::string& socketPath);
+
+    // Sets id as soon as it is known, so failed requests can still be answered with it
+    inline std::optional< RenderRequest >
+    parseRequest(const std::string& line, std::string& id, std::string& error) const;
+
+private:
+    using JsonValue = std::variant< double, std::string, std::vector< double > >;
+
+    inline void               process(std::vector< RenderRequest >& batch, FILE* out);
+    inline static bool        parseObject(const std::string& line, std::map< std::string, JsonValue >& fields);
+    inline static std::string escape(const std::string& s);
+    inline static void        reportError(FILE* out, const std::string& id, const std::string& error);
+
+    Render&       render_;
+    RenderRequest defaults_;
+    int           width_{-1}, height_{-1};
+};
+
+void RenderServer::serve(FILE* in, FILE* out)
+{
+    // Parsing runs on its own thread, so requests arriving during a render queue up and are batched
+    tbb::concurrent_bounded_queue< std::optional< RenderRequest > > queue;
+
+    std::thread reader([&] {
+        char*       line = nullptr;
+        std::size_t cap  = 0;
+        while (getline(&line, &cap, in) > 0)
+        {
+            std::string id, error;
+            auto        request = parseRequest(line, id, error);
+            if (request)
+                queue.push(std::move(request));
+            else if (!error.empty())
+                reportError(out, id, error);
+        }
+        free(line);
+        queue.push(std::nullopt);
+    });
+
+    std::vector< RenderRequest >   batch;
+    std::optional< RenderRequest > request;
+    bool                           done = false;
+    while (!done)
+    {
+        queue.pop(request);
+        do
+        {
+            if (!request)
+            {
+                done = true;
+                break;
+            }
+            batch.push_back(std::move(*request));
+        } while (queue.try_pop(request));
+        process(batch, out);
+        batch.clear();
+    }
+    reader.join();
+}
+
+void RenderServer::serveSocket(const std::string& socketPath)
+{
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        perror("socket");
+        return;
+    }
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(socketPath.c_str());
+    if (bind(listener, reinterpret_cast< sockaddr* >(&addr), sizeof addr) != 0 || listen(listener, 8) != 0)
+    {
+        perror("bind");
+        close(listener);
+        return;
+    }
+    while (true)
+    {
+        int conn = accept(listener, nullptr, nullptr);
+        if (conn < 0)
+        {
+            perror("accept");
+            break;
+        }
+        FILE* in  = fdopen(conn, "r");
+        FILE* out = fdopen(dup(conn), "w");
+        serve(in, out);
+        fclose(out);
+        fclose(in);
+    }
+    close(listener);
+}
+
+void RenderServer::process(std::vector< RenderRequest >& batch, FILE* out)
+{
+    // Same-sized requests go together so the framebuffer is reallocated at most once per size
+    std::stable_sort(batch.begin(), batch.end(), [](const RenderRequest& a, const RenderRequest& b) {
+        return std::make_pair(a.width, a.height) < std::make_pair(b.width, b.height);
+    });
+    for (const auto& request : batch)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        if (request.width != width_ || request.height != height_)
+        {
+            width_  = request.width;
+            height_ = request.height;
+            render_.prepare(width_, height_);
+        }
+        render_.getCamera() = request.camera;
+        render_.renderImage(request.mode, request.batch_size);
+        if (!render_.saveTo(request.path))
+        {
+            reportError(out, request.id, "can not write " + request.path);
+            continue;
+        }
+        const auto end = std::chrono::steady_clock::now();
+
+        using ms = std::chrono::duration< double, std::milli >;
+        fprintf(out,
+                "{\"id\": \"%s\", \"path\": \"%s\", \"batch\": %zu, \"queue_ms\": %.3f, \"render_ms\": %.3f, "
+                "\"latency_ms\": %.3f}\n",
+                escape(request.id).c_str(),
+                escape(request.path).c_str(),
+                batch.size(),
+                ms(start - request.received).count(),
+                ms(end - start).count(),
+                ms(end - request.received).count());
+        fflush(out);
+    }
+}
+
+std::optional< RenderRequest >
+RenderServer::parseRequest(const std::string& line, std::string& id, std::string& error) const
+{
+    std::map< std::string, JsonValue > fields;
+    if (line.find_first_not_of(" \t\r\n") == std::string::npos)
+        return std::nullopt;
+    if (!parseObject(line, fields))
+    {
+        error = "malformed request";
+        return std::nullopt;
+    }
+
+    RenderRequest request = defaults_;
+    request.received      = std::chrono::steady_clock::now();
+    auto number           = [&](const char* key, auto& value) {
+        if (auto it = fields.find(key); it != fields.end())
+        {
+            if (auto* d = std::get_if< double >(&it->second))
+                value = static_cast< std::remove_reference_t< decltype(value) > >(*d);
+            else
+                error = std::string("expected a number for ") + key;
+        }
+    };
+    auto point = [&](const char* key, Eigen::Vector4d& value, double w) {
+        if (auto it = fields.find(key); it != fields.end())
+        {
+            auto* v = std::get_if< std::vector< double > >(&it->second);
+            if (v && v->size() == 3)
+                value = Eigen::Vector4d((*v)[0], (*v)[1], (*v)[2], w);
+            else
+                error = std::string("expected [x, y, z] for ") + key;
+        }
+    };
+    auto string = [&](const char* key, std::string& value) {
+        if (auto it = fields.find(key); it != fields.end())
+        {
+            if (auto* s = std::get_if< std::string >(&it->second))
+                value = *s;
+            else if (auto* d = std::get_if< double >(&it->second))
+                value = std::to_string(static_cast< long long >(*d));
+            else
+                error = std::string("expected a string for ") + key;
+        }
+    };
+
+    std::string mode;
+    string("id", request.id);
+    id = request.id;
+    string("path", request.path);
+    string("mode", mode);
+    point("pos", request.camera.pos, 1.0);
+    point("screen", request.camera.screenCenter, 1.0);
+    point("up", request.camera.up, 0.0);
+    number("fov", request.camera.fov);
+    number("width", request.width);
+    number("height", request.height);
+    number("batch", request.batch_size);
+
+    if (mode == "cpu")
+        request.mode = RenderMode::CPU;
+    else if (mode == "tbb")
+        request.mode = RenderMode::TBB;
+    else if (mode == "simd")
+        request.mode = RenderMode::SIMD;
+    else if (mode == "bvh")
+        request.mode = RenderMode::BVH;
+    else if (!mode.empty())
+        error = "unknown mode " + mode;
+    if (request.width <= 0 || request.height <= 0)
+        error = "invalid resolution";
+    // Powers of two up to maxBatchSize, the batch sizes renderRows has SIMD kernels for
+    if (request.batch_size < 1 || request.batch_size > maxBatchSize || (request.batch_size & (request.batch_size - 1)))
+        error = "invalid batch size";
+
+    if (!error.empty())
+        return std::nullopt;
+    return request;
+}
+
+// Flat JSON objects only: string, number and number array values
+bool RenderServer::parseObject(const std::string& line, std::map< std::string, JsonValue >& fields)
+{
+    std::size_t pos  = 0;
+    auto        skip = [&] {
+        while (pos < line.size() && std::isspace(static_cast< unsigned char >(line[pos])))
+            pos++;
+    };
+    auto expect = [&](char c) {
+        skip();
+        if (pos >= line.size() || line[pos] != c)
+            return false;
+        pos++;
+        return true;
+    };
+    auto parseString = [&](std::string& s) {
+        if (!expect('"'))
+            return false;
+        while (pos < line.size() && line[pos] != '"')
+        {
+            if (line[pos] == '\\' && pos + 1 < line.size())
+                pos++;
+            s += line[pos++];
+        }
+        return expect('"');
+    };
+    auto parseNumber = [&](double& d) {
+        skip();
+        const char* begin = line.c_str() + pos;
+        char*       end;
+        d = std::strtod(begin, &end);
+        if (end == begin)
+            return false;
+        pos += end - begin;
+        return true;
+    };
+
+    if (!expect('{'))
+        return false;
+    skip();
+    if (pos < line.size() && line[pos] == '}')
+        return true;
+    do
+    {
+        std::string key;
+        if (!parseString(key) || !expect(':'))
+            return false;
+        skip();
+        if (pos < line.size() && line[pos] == '"')
+        {
+            std::string value;
+            if (!parseString(value))
+                return false;
+            fields[key] = value;
+        }
+        else if (pos < line.size() && line[pos] == '[')
+        {
+            pos++;
+            std::vector< double > values;
+            skip();
+            if (pos < line.size() && line[pos] == ']')
+                pos++;
+            else
+            {
+                do
+                {
+                    double d;
+                    if (!parseNumber(d))
+                        return false;
+                    values.push_back(d);
+                } while (expect(','));
+                if (!expect(']'))
+                    return false;
+            }
+            fields[key] = values;
+        }
+        else
+        {
+            double d;
+            if (!parseNumber(d))
+                return false;
+            fields[key] = d;
+        }
+    } while (expect(','));
+    return expect('}');
+}
+
+void RenderServer::reportError(FILE* out, const std::string& id, const std::string& error)
+{
+    if (id.empty())
+        fprintf(out, "{\"error\": \"%s\"}\n", escape(error).c_str());
+    else
+        fprintf(out, "{\"id\": \"%s\", \"error\": \"%s\"}\n", escape(id).c_str(), escape(error).c_str());
+    fflush(out);
+}
+
+std::string RenderServer::escape(const std::string& s)
+{
+    std::string out;
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out;
+}
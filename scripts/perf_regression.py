@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+"""Runs the benchmark target and flags slowdowns against a saved baseline.
+
+Record a baseline once, on the machine that will run the comparisons:
+
+    scripts/perf_regression.py --benchmark build/benchmark --save baseline.json
+
+then compare later builds against it:
+
+    scripts/perf_regression.py --benchmark build/benchmark --baseline baseline.json --threshold 0.10
+
+Exits with 1 when any benchmark got slower than the threshold (a fraction of the baseline time).
+"""
+
+import argparse
+import json
+import subprocess
+import sys
+import tempfile
+
+
+def run_benchmark(binary, benchmark_filter, repetitions):
+    with tempfile.NamedTemporaryFile(suffix=".json") as out:
+        cmd = [
+            binary,
+            f"--benchmark_out={out.name}",
+            "--benchmark_out_format=json",
+            f"--benchmark_repetitions={repetitions}",
+            "--benchmark_report_aggregates_only=true",
+        ]
+        if benchmark_filter:
+            cmd.append(f"--benchmark_filter={benchmark_filter}")
+        subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL)
+        with open(out.name) as f:
+            return json.load(f)
+
+
+def times(report):
+    """Median real time of every benchmark in milliseconds."""
+    scale = {"ns": 1e-6, "us": 1e-3, "ms": 1.0, "s": 1e3}
+    result = {}
+    for b in report["benchmarks"]:
+        if b.get("run_type") == "aggregate" and b.get("aggregate_name") != "median":
+            continue
+        result[b["run_name"]] = b["real_time"] * scale[b.get("time_unit", "ns")]
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--benchmark", default="./benchmark", help="benchmark executable")
+    parser.add_argument("--filter", default="", help="passed on as --benchmark_filter")
+    parser.add_argument("--repetitions", type=int, default=3)
+    parser.add_argument("--save", help="store the results as a new baseline")
+    parser.add_argument("--baseline", help="baseline to compare against")
+    parser.add_argument("--threshold", type=float, default=0.10, help="allowed slowdown, 0.10 is 10%%")
+    args = parser.parse_args()
+
+    if not args.save and not args.baseline:
+        parser.error("nothing to do, pass --save and/or --baseline")
+
+    report = run_benchmark(args.benchmark, args.filter, args.repetitions)
+    if args.save:
+        with open(args.save, "w") as f:
+            json.dump(report, f, indent=2)
+        print(f"baseline saved to {args.save}")
+    if not args.baseline:
+        return 0
+
+    with open(args.baseline) as f:
+        baseline = times(json.load(f))
+    current = times(report)
+
+    slower = []
+    print(f"{'benchmark':<50} {'baseline ms':>12} {'current ms':>12} {'change':>8}")
+    for name, now in sorted(current.items()):
+        before = baseline.get(name)
+        if before is None:
+            print(f"{name:<50} {'-':>12} {now:12.3f} {'new':>8}")
+            continue
+        change = now / before - 1.0
+        flag = "  SLOWER" if change > args.threshold else ""
+        print(f"{name:<50} {before:12.3f} {now:12.3f} {change:+8.1%}{flag}")
+        if change > args.threshold:
+            slower.append(name)
+    for name in sorted(set(baseline) - set(current)):
+        print(f"{name:<50} {baseline[name]:12.3f} {'-':>12} {'gone':>8}")
+
+    if slower:
+        print(f"{len(slower)} benchmark(s) slower than {args.threshold:.0%} over the baseline")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
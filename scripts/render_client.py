@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+"""Sends a batch of render requests to `ray --server` and prints the reported latencies.
+
+Starts the server itself unless --socket points at one that is already running:
+
+    scripts/render_client.py --ray build/ray --frames 20 --size 320 240
+    scripts/render_client.py --socket /tmp/ray.sock --frames 20
+"""
+
+import argparse
+import json
+import math
+import socket
+import subprocess
+import sys
+
+
+def requests(frames, width, height, mode, out):
+    for i in range(frames):
+        fi = i / 5.0
+        yield {
+            "id": str(i),
+            "pos": [100.0 * math.cos(fi), 100.0 * math.sin(fi), 30.0],
+            "screen": [90.0 * math.cos(fi), 90.0 * math.sin(fi), 25.0],
+            "width": width,
+            "height": height,
+            "mode": mode,
+            "path": f"{out}{i}.bmp",
+        }
+
+
+def read_answers(lines, expected):
+    answers = []
+    for line in lines:
+        line = line.strip()
+        if not line:
+            continue
+        answer = json.loads(line)
+        answers.append(answer)
+        # Every request gets exactly one line, an answer or an error
+        if "error" in answer:
+            print(f"error: request {answer.get('id', '?')}: {answer['error']}", file=sys.stderr)
+        if len(answers) >= expected:
+            break
+    return answers
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--ray", default="./ray", help="ray executable started with --server")
+    parser.add_argument("--socket", help="connect to a server listening on this Unix socket instead")
+    parser.add_argument("--frames", type=int, default=10)
+    parser.add_argument("--size", type=int, nargs=2, default=[320, 240], metavar=("WIDTH", "HEIGHT"))
+    parser.add_argument("--mode", default="bvh", choices=["cpu", "tbb", "simd", "bvh"])
+    parser.add_argument("--out", default="frame_", help="prefix of the output files")
+    args = parser.parse_args()
+
+    payload = "".join(
+        json.dumps(r) + "\n" for r in requests(args.frames, args.size[0], args.size[1], args.mode, args.out)
+    )
+
+    if args.socket:
+        with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as conn:
+            conn.connect(args.socket)
+            conn.sendall(payload.encode())
+            conn.shutdown(socket.SHUT_WR)
+            answers = read_answers(conn.makefile("r"), args.frames)
+    else:
+        server = subprocess.Popen([args.ray, "--server"], stdin=subprocess.PIPE, stdout=subprocess.PIPE, text=True)
+        server.stdin.write(payload)
+        server.stdin.close()
+        answers = read_answers(server.stdout, args.frames)
+        server.wait()
+
+    for a in answers:
+        if "render_ms" in a:
+            print(f"{a['id']:>4} {a['path']:<20} batch {a['batch']:>3}  queue {a['queue_ms']:9.2f} ms  "
+                  f"render {a['render_ms']:9.2f} ms  latency {a['latency_ms']:9.2f} ms")
+    renders = [a["render_ms"] for a in answers if "render_ms" in a]
+    if renders:
+        print(f"{len(renders)} frames, mean render {sum(renders) / len(renders):.2f} ms")
+    return 0 if len(renders) == args.frames else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -102,6 +102,102 @@ static void BM_Simd(benchmark::State& state) {
     }
 }
 
+static void BM_Bvh(benchmark::State& state)
+{
+    auto render =  prapareSpheres();
+
+    for (auto _ : state)
+    {
+        render.renderImage(RenderMode::BVH);
+    }
+}
+
+// Rolling terrain of state.range(0)^2 quads under the spheres, two triangles each
+static void BM_BvhMesh(benchmark::State& state)
+{
+    prapareSpheres();
+    const int             n = state.range(0);
+    std::vector< Obj3D* > scene(objs, objs + noOfSpheres);
+    auto                  vertex = [n](int i, int j) {
+        const double x = -80.0 + 160.0 * i / n, y = -80.0 + 160.0 * j / n;
+        return Eigen::Vector4d(x, y, 3 + 2 * std::sin(x / 7) * std::cos(y / 9), 1);
+    };
+    for (int j = 0; j < n; j++)
+        for (int i = 0; i < n; i++)
+        {
+            scene.push_back(new Triangle(vertex(i, j), vertex(i + 1, j), vertex(i + 1, j + 1), Color{200, 200, 200}));
+            scene.push_back(new Triangle(vertex(i, j), vertex(i + 1, j + 1), vertex(i, j + 1), Color{200, 200, 200}));
+        }
+    Render render(cam, lights, scene.data(), scene.size());
+    render.prepare(1920, 1080);
+
+    for (auto _ : state)
+    {
+        render.renderImage(RenderMode::BVH);
+    }
+    state.counters["triangles"] = 2.0 * n * n;
+    for (size_t i = noOfSpheres; i < scene.size(); i++)
+        delete scene[i];
+}
+
+// Moves every sphere a bit per iteration, like a simulation step would
+static void BM_Refit(benchmark::State& state)
+{
+    auto render =  prapareSpheres();
+    render.updateLod();
+
+    std::vector< SphereUpdate > updates(noOfSpheres);
+    int                         frame = 0;
+    for (auto _ : state)
+    {
+        const double t = 0.1 * frame++;
+        for (size_t i = 0; i < noOfSpheres; i++)
+        {
+            auto*           sphere = static_cast< Sphere* >(objs[i]);
+            Eigen::Vector4d offset(std::sin(t + i), std::cos(t + i), 0, 0);
+            updates[i] = {i, sphere->getCenter() + offset, sphere->getRadius()};
+        }
+        render.updateSpheres(updates);
+    }
+}
+
+// Renders a few frames, each one saved while the next renders
+static Task<> renderAndSave(Render& render, int frames)
+{
+    AsyncJob saved;
+    for (int i = 0; i < frames; i++)
+    {
+        co_await render.renderAsync(cam, RenderMode::BVH);
+        co_await saved;
+        saved = render.saveAsync("benchmark.bmp");
+    }
+    co_await saved;
+}
+
+static void BM_AsyncRenderSave(benchmark::State& state)
+{
+    auto render =  prapareSpheres();
+
+    for (auto _ : state)
+    {
+        syncWait(renderAndSave(render, 3));
+    }
+}
+
+static void BM_SyncRenderSave(benchmark::State& state)
+{
+    auto render =  prapareSpheres();
+
+    for (auto _ : state)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            render.renderImage(RenderMode::BVH);
+            render.saveTo("benchmark.bmp");
+        }
+    }
+}
+
 static void BM_Save(benchmark::State& state) {
     int size = state.range(0);
     
@@ -114,11 +210,52 @@ static void BM_Save(benchmark::State& state) {
     }
 }
 
+// Writes every pixel the way the TBB renderer does, to see where the framebuffer pages ended up
+static void fillImage(Image& img, RowScheduler& scheduler)
+{
+    scheduler.forEachRows(0, static_cast< int >(img.getHeight()), [&](tbb::blocked_range< int > r) {
+        for (int j = r.begin(); j < r.end(); ++j)
+            for (std::size_t i = 0; i < img.getWidth(); ++i)
+                img.setPixel(i, j, Color{static_cast< std::uint8_t >(i), static_cast< std::uint8_t >(j), 0});
+    });
+}
+
+static void BM_ImageSerialTouch(benchmark::State& state)
+{
+    RowScheduler scheduler;
+
+    for (auto _ : state)
+    {
+        Image img(7680, 4320);
+        fillImage(img, scheduler);
+        benchmark::DoNotOptimize(img.row(0));
+    }
+}
+
+static void BM_ImageFirstTouch(benchmark::State& state)
+{
+    RowScheduler scheduler;
+
+    for (auto _ : state)
+    {
+        Image img(7680, 4320, scheduler);
+        fillImage(img, scheduler);
+        benchmark::DoNotOptimize(img.row(0));
+    }
+}
+
 
 BENCHMARK(BM_Prepare)->UseRealTime()->Unit(benchmark::kMillisecond);
 BENCHMARK(BM_Serial)->UseRealTime()->Unit(benchmark::kMillisecond);
 BENCHMARK(BM_TBB)->Iterations(3)->UseRealTime()->Unit(benchmark::kMillisecond);
 BENCHMARK(BM_Simd)->Iterations(3)->UseRealTime()->Unit(benchmark::kMillisecond)->RangeMultiplier(2)->Range(2, 128);
+BENCHMARK(BM_Bvh)->Iterations(3)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_BvhMesh)->Iterations(3)->UseRealTime()->Unit(benchmark::kMillisecond)->RangeMultiplier(8)->Range(64, 512);
+BENCHMARK(BM_Refit)->UseRealTime()->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_AsyncRenderSave)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_SyncRenderSave)->UseRealTime()->Unit(benchmark::kMillisecond);
 BENCHMARK(BM_Save)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_ImageSerialTouch)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_ImageFirstTouch)->UseRealTime()->Unit(benchmark::kMillisecond);
 
 BENCHMARK_MAIN();
\ No newline at end of file
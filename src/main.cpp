@@ -1,11 +1,15 @@
+#include "Distributed.hpp"
+#include "Mesh.hpp"
 #include "Obj.hpp"
 #include "Render.hpp"
+#include "Server.hpp"
 
 #include <Eigen/Dense>
 #include <cxxopts.hpp>
 
 #include <filesystem>
 #include <iostream>
+#include <memory>
 #include <random>
 #include <vector>
 
@@ -17,6 +21,17 @@ struct Params
     std::string path;
     RenderMode  mode;
     bool        presentation;
+    unsigned    aovMask;
+    int         bandRows;
+    int         procs;
+    int         spheres;
+    int         boxes;
+    int         cylinders;
+    std::string mesh;
+    double      meshScale;
+    double      lod;
+    bool        server;
+    std::string socket;
 };
 
 Params parseArgs(int argc, char** argv)
@@ -29,7 +44,29 @@ Params parseArgs(int argc, char** argv)
         "c,cpu", "CPU mode", cxxopts::value< bool >()->default_value("false"))(
         "t,tbb", "TBB mode", cxxopts::value< bool >()->default_value("false"))(
         "m,simd", "SIMD mode", cxxopts::value< bool >()->default_value("false"))(
+        "v,bvh", "BVH mode", cxxopts::value< bool >()->default_value("false"))(
         "p,show", "Generate 20 bmp from rotating camera", cxxopts::value< bool >()->default_value("false"))(
+        "b,band",
+        "Rows rendered and written per band, 0 keeps the whole image in memory",
+        cxxopts::value< int >()->default_value("0"))(
+        "n,procs",
+        "Worker processes rendering tiles of the image, 0 renders in this process",
+        cxxopts::value< int >()->default_value("0"))(
+        "k,spheres", "Number of random spheres in the scene", cxxopts::value< int >()->default_value("1024"))(
+        "boxes", "Number of random boxes in the scene", cxxopts::value< int >()->default_value("0"))(
+        "cylinders", "Number of random cylinders in the scene", cxxopts::value< int >()->default_value("0"))(
+        "mesh", "OBJ mesh added to the scene", cxxopts::value< std::string >()->default_value(""))(
+        "mesh-scale", "Scale applied to the mesh vertices", cxxopts::value< double >()->default_value("1"))(
+        "l,lod",
+        "Splat spheres smaller than this many pixels instead of tracing them, 0 disables",
+        cxxopts::value< double >()->default_value("0"))(
+        "server", "Serve JSON render requests from stdin", cxxopts::value< bool >()->default_value("false"))(
+        "socket",
+        "Serve render requests on this Unix socket instead of stdin",
+        cxxopts::value< std::string >()->default_value(""))(
+        "a,aov",
+        "Extra outputs saved next to the bmp (depth,normal,id)",
+        cxxopts::value< std::vector< std::string > >()->default_value(""))(
         "h,help", "Print usage");
     auto result = options.parse(argc, argv);
     if (result.count("help"))
@@ -43,7 +80,66 @@ Params parseArgs(int argc, char** argv)
     p.height       = shape[1];
     p.path         = result["file"].as< std::string >();
     p.presentation = result["show"].as< bool >();
+    p.bandRows     = result["band"].as< int >();
+    p.procs        = result["procs"].as< int >();
+    p.spheres      = result["spheres"].as< int >();
+    p.boxes        = result["boxes"].as< int >();
+    p.cylinders    = result["cylinders"].as< int >();
+    p.mesh         = result["mesh"].as< std::string >();
+    p.meshScale    = result["mesh-scale"].as< double >();
+    p.lod          = result["lod"].as< double >();
+    p.socket       = result["socket"].as< std::string >();
+    p.server       = result["server"].as< bool >() || !p.socket.empty();
 
+    p.aovMask = AovNone;
+    for (const auto& aov : result["aov"].as< std::vector< std::string > >())
+    {
+        if (aov == "depth")
+            p.aovMask |= AovDepth;
+        else if (aov == "normal")
+            p.aovMask |= AovNormal;
+        else if (aov == "id")
+            p.aovMask |= AovObjectId;
+        else if (!aov.empty())
+            std::cerr << "Unknown AOV: " << aov << std::endl;
+    }
+
+    // Worker processes return colour rows of a full in-memory frame only
+    if (p.procs > 0 && p.aovMask != AovNone)
+    {
+        std::cerr << "--aov can not be combined with --procs" << std::endl;
+        exit(1);
+    }
+    if (p.procs > 0 && p.bandRows > 0)
+    {
+        std::cerr << "--band can not be combined with --procs" << std::endl;
+        exit(1);
+    }
+    // The server renders every request in this process
+    if (p.procs > 0 && p.server)
+    {
+        std::cerr << "--procs can not be combined with --server or --socket" << std::endl;
+        exit(1);
+    }
+    // Requests are answered with a colour BMP each, rendered whole in memory
+    if (p.server && p.aovMask != AovNone)
+    {
+        std::cerr << "--aov can not be combined with --server or --socket" << std::endl;
+        exit(1);
+    }
+    if (p.server && p.bandRows > 0)
+    {
+        std::cerr << "--band can not be combined with --server or --socket" << std::endl;
+        exit(1);
+    }
+    // Presentation frames are rendered whole in memory so each one can be saved while the next renders
+    if (p.presentation && p.bandRows > 0)
+    {
+        std::cerr << "--band can not be combined with --show" << std::endl;
+        exit(1);
+    }
+
+    p.mode = RenderMode::TBB;
     if (result["cpu"].as< bool >())
     {
         p.mode = RenderMode::CPU;
@@ -56,6 +152,10 @@ Params parseArgs(int argc, char** argv)
     {
         p.mode = RenderMode::SIMD;
     }
+    if (result["bvh"].as< bool >())
+    {
+        p.mode = RenderMode::BVH;
+    }
     return p;
 }
 
@@ -84,13 +184,60 @@ void generateSpheres(Obj3D** objs, size_t noOfSpheres)
     }
 }
 
-int main(int argc, char** argv)
+// Boxes and upright cylinders standing on the ground between the spheres
+void generateSolids(std::vector< Obj3D* >& objs, size_t noOfBoxes, size_t noOfCylinders)
 {
-    constexpr size_t noOfSpheres = 1024;
-    constexpr size_t noOfPlanes  = 0;
+    std::mt19937                             mt(2024);
+    std::uniform_real_distribution< double > size(1, 8);
+    std::uniform_real_distribution< double > coord(-80, 80);
+    std::uniform_int_distribution< uint8_t > color(0, 255);
+
+    for (size_t i = 0; i < noOfBoxes; i++)
+    {
+        Eigen::Vector4d lo(coord(mt), coord(mt), 0, 1);
+        Eigen::Vector4d extent(size(mt), size(mt), size(mt), 0);
+        objs.push_back(new Box(lo, lo + extent, Color{color(mt), color(mt), color(mt)}));
+    }
+    for (size_t i = 0; i < noOfCylinders; i++)
+    {
+        Eigen::Vector4d base(coord(mt), coord(mt), 0, 1);
+        double          radius = size(mt) / 2;
+        double          height = size(mt);
+        objs.push_back(
+            new Cylinder(base, Eigen::Vector4d(0, 0, 1, 0), radius, height, Color{color(mt), color(mt), color(mt)}));
+    }
+}
 
+Camera presentationCamera(Camera cam, size_t frame)
+{
+    double fi        = frame / 5.0;
+    cam.pos          = Eigen::Vector4d(100.0 * cos(fi), 100.0 * sin(fi), 30.0, 1.0);
+    cam.screenCenter = Eigen::Vector4d(90.0 * cos(fi), 90.0 * sin(fi), 25.0, 1.0);
+    return cam;
+}
+
+// Each frame is written to disk while the next one renders
+Task<> renderPresentation(Render& render, Camera cam, const Params& param)
+{
+    AsyncJob saved;
+    for (size_t i = 0; i < 60; i++)
+    {
+        co_await render.renderAsync(presentationCamera(cam, i), param.mode);
+        if (param.aovMask)
+            render.saveAovTo("show/" + std::to_string(i));
+        co_await saved;
+        saved = render.saveAsync("show/" + std::to_string(i) + ".bmp");
+    }
+    co_await saved;
+}
+
+int main(int argc, char** argv)
+{
     Params param = parseArgs(argc, argv);
 
+    const size_t     noOfSpheres = param.spheres;
+    constexpr size_t noOfPlanes  = 0;
+
     Eigen::Vector4d pos(-100.0, -100.0, 30.0, 1.0);
     Eigen::Vector4d screen(-90.0, -90.0, 25.0, 1.0);
     Eigen::Vector4d up(0.0, 0.0, 1.0, 0.0);
@@ -107,43 +254,81 @@ int main(int argc, char** argv)
     Eigen::Vector4d      l4(50.0, 50.0, 50.0, 1.0);
     lights.push_back(Light(l4, Color(255, 255, 255)));
 
-    Obj3D* objs[noOfSpheres + noOfPlanes];
-    generateSpheres(objs, noOfSpheres);
-    objs[noOfSpheres] = new Plane();
-    std::cout << "Allocation done" << std::endl;
+    // In server mode stdout carries only the JSON answers
+    std::ostream& log = param.server ? std::cerr : std::cout;
+
+    std::vector< Obj3D* > objs(noOfSpheres + noOfPlanes);
+    generateSpheres(objs.data(), noOfSpheres);
+    for (size_t i = 0; i < noOfPlanes; i++)
+        objs[noOfSpheres + i] = new Plane();
+    generateSolids(objs, param.boxes, param.cylinders);
+    if (!param.mesh.empty())
+    {
+        long triangles = loadObjMesh(param.mesh, Color{200, 200, 200}, objs, param.meshScale);
+        if (triangles < 0)
+            return 1;
+        log << "Loaded " << triangles << " triangles" << std::endl;
+    }
+    log << "Allocation done" << std::endl;
 
-    Render render(cam, lights, objs, noOfPlanes + noOfSpheres);
+    Render render(cam, lights, objs.data(), objs.size());
+    render.setAovMask(param.aovMask);
+    render.setLodThreshold(param.lod);
 
-    if (param.presentation)
+    std::unique_ptr< TileCoordinator > coordinator;
+    if (param.procs > 0)
+        coordinator = std::make_unique< TileCoordinator >(render, param.procs);
+
+    if (param.server)
+    {
+        RenderRequest defaults{"", cam, param.width, param.height, param.path, param.mode, 8};
+        RenderServer  server(render, defaults);
+        if (param.socket.empty())
+            server.serve(stdin, stdout);
+        else
+            server.serveSocket(param.socket);
+    }
+    else if (param.presentation)
     {
         fs::remove_all("show");
         if (!fs::create_directory("show"))
             std::cerr << "Can not create communication folder";
-        for (size_t i = 0; i < 60; i++)
+        if (coordinator)
+        {
+            for (size_t i = 0; i < 60; i++)
+            {
+                cam = presentationCamera(cam, i);
+                render.prepare(param.width, param.height);
+                coordinator->renderImage(param.mode);
+                render.saveTo("show/" + std::to_string(i) + ".bmp");
+            }
+        }
+        else
         {
-            double fi        = i / 5.0;
-            cam.pos          = Eigen::Vector4d(100.0 * cos(fi), 100.0 * sin(fi), 30.0, 1.0);
-            cam.screenCenter = Eigen::Vector4d(90.0 * cos(fi), 90.0 * sin(fi), 25.0, 1.0);
             render.prepare(param.width, param.height);
-            render.renderImage(param.mode);
-            render.saveTo( "show/" + std::to_string(i) + ".bmp");
+            syncWait(renderPresentation(render, cam, param));
         }
         if(system("ffmpeg -f image2 -i ./show/%d.bmp ./show/out.mov"))
         {
             std::cerr << "FFMPEG return " << errno << std::endl;
         }
     }
-    else
+    else if (coordinator)
     {
         render.prepare(param.width, param.height);
-        render.renderImage(param.mode);
+        coordinator->renderImage(param.mode);
         render.saveTo(param.path);
     }
+    else
+    {
+        render.prepare(param.width, param.height, param.bandRows);
+        render.renderToBmp(param.mode, param.path, 8, fs::path(param.path).replace_extension().string());
+    }
 
-    std::cout << "Free mem" << std::endl;
+    log << "Free mem" << std::endl;
 
-    for (size_t i = 0; i < noOfSpheres + noOfPlanes; i++)
+    for (auto* obj : objs)
     {
-        delete (objs[i]);
+        delete (obj);
     }
 }
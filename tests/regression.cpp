@@ -0,0 +1,373 @@
+#include "Mesh.hpp"
+#include "Obj.hpp"
+#include "Render.hpp"
+
+#include <Eigen/Dense>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Renders the reference scenes in every RenderMode and compares them with the golden images.
+// Usage: regression <golden dir> [--update], --update rewrites the golden images from the CPU mode.
+
+namespace fs = std::filesystem;
+
+constexpr int width  = 128;
+constexpr int height = 96;
+
+// Largest per-channel difference still counted as equal and share of pixels allowed above it
+constexpr int    channelTolerance = 2;
+constexpr double pixelTolerance   = 0.001;
+
+// Spheres smaller than this many pixels are splatted in the LOD checks. Against the golden image LOD frames may
+// differ by more than lodChannelTolerance on lodPixelTolerance of the pixels, splat outlines and shading are coarse.
+constexpr double lodPixels           = 4.0;
+constexpr int    lodChannelTolerance = 32;
+constexpr double lodPixelTolerance   = 0.004;
+
+struct Scene
+{
+    std::string           name;
+    std::vector< Obj3D* > objs;
+    Camera                cam;
+    std::vector< Light >  lights;
+};
+
+std::vector< Obj3D* > generateSpheres(size_t noOfSpheres, unsigned seed)
+{
+    std::mt19937                             mt(seed);
+    std::uniform_real_distribution< double > r(0.5, 5);
+    std::uniform_real_distribution< double > coord(-80, 80);
+    std::uniform_int_distribution< uint8_t > color(0, 255);
+
+    std::vector< Obj3D* > objs;
+    for (size_t i = 0; i < noOfSpheres; i++)
+    {
+        double          R = r(mt);
+        Eigen::Vector4d center(coord(mt), coord(mt), R, 1);
+        objs.push_back(new Sphere(center, R, Color{color(mt), color(mt), color(mt)}));
+    }
+    return objs;
+}
+
+// Random boxes and cylinders with random axes, the cylinders partly tilted into the ground
+std::vector< Obj3D* > generateSolids(size_t noOfSolids, unsigned seed)
+{
+    std::mt19937                             mt(seed);
+    std::uniform_real_distribution< double > size(1, 8);
+    std::uniform_real_distribution< double > coord(-40, 40);
+    std::uniform_real_distribution< double > tilt(-1, 1);
+    std::uniform_int_distribution< uint8_t > color(0, 255);
+
+    std::vector< Obj3D* > objs;
+    for (size_t i = 0; i < noOfSolids; i++)
+    {
+        Eigen::Vector4d lo(coord(mt), coord(mt), 0, 1);
+        Eigen::Vector4d extent(size(mt), size(mt), size(mt), 0);
+        objs.push_back(new Box(lo, lo + extent, Color{color(mt), color(mt), color(mt)}));
+
+        Eigen::Vector4d base(coord(mt), coord(mt), 0, 1);
+        Eigen::Vector4d axis(tilt(mt), tilt(mt), 1, 0);
+        double          radius = size(mt) / 2;
+        double          height = 2 * size(mt);
+        objs.push_back(new Cylinder(base, axis, radius, height, Color{color(mt), color(mt), color(mt)}));
+    }
+    return objs;
+}
+
+// Square pyramid with a quad base, written in the index forms OBJ exporters use
+std::vector< Obj3D* > pyramidMesh()
+{
+    const fs::path path = fs::temp_directory_path() / "regression_pyramid.obj";
+    std::ofstream(path) << "# pyramid\n"
+                           "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\nv 0.5 0.5 1\n"
+                           "vn 0 0 1\n"
+                           "f 4//1 3//1 2//1 1//1\n"
+                           "f 1/1/1 2/1/1 5/1/1\n"
+                           "f 2 3 5\n"
+                           "f -2 -1 -3\n"
+                           "f 4 1 -1\n";
+    std::vector< Obj3D* > objs;
+    loadObjMesh(path.string(), Color{200, 200, 200}, objs, 20.0, Eigen::Vector4d(-5.0, -30.0, 0.0, 0.0));
+    fs::remove(path);
+    return objs;
+}
+
+std::vector< Light > cornerLights()
+{
+    std::vector< Light > lights;
+    for (double x : {-50.0, 50.0})
+        for (double y : {-50.0, 50.0})
+            lights.push_back(Light(Eigen::Vector4d(x, y, 50.0, 1.0), Color(255, 255, 255)));
+    return lights;
+}
+
+std::vector< Scene > referenceScenes()
+{
+    std::vector< Scene > scenes;
+
+    // The scene ray renders by default
+    scenes.push_back({"spheres",
+                      generateSpheres(1024, 2023),
+                      Camera(Eigen::Vector4d(-100.0, -100.0, 30.0, 1.0),
+                             Eigen::Vector4d(-90.0, -90.0, 25.0, 1.0),
+                             Eigen::Vector4d(0.0, 0.0, 1.0, 0.0),
+                             80.0),
+                      cornerLights()});
+
+    // Spheres on the ground plane, seen from inside the field so some of them are behind the camera
+    Scene plane{"plane",
+                generateSpheres(256, 7),
+                Camera(Eigen::Vector4d(20.0, -60.0, 15.0, 1.0),
+                       Eigen::Vector4d(25.0, -50.0, 12.0, 1.0),
+                       Eigen::Vector4d(0.0, 0.0, 1.0, 0.0),
+                       90.0),
+                cornerLights()};
+    plane.objs.push_back(new Plane());
+    scenes.push_back(std::move(plane));
+
+    // Triangles, boxes and cylinders together with spheres and the ground plane
+    Scene solids{"solids",
+                 generateSolids(40, 5),
+                 Camera(Eigen::Vector4d(-70.0, -70.0, 40.0, 1.0),
+                        Eigen::Vector4d(-60.0, -60.0, 34.0, 1.0),
+                        Eigen::Vector4d(0.0, 0.0, 1.0, 0.0),
+                        70.0),
+                 cornerLights()};
+    for (auto* obj : pyramidMesh())
+        solids.objs.push_back(obj);
+    for (auto* obj : generateSpheres(64, 11))
+        solids.objs.push_back(obj);
+    solids.objs.push_back(new Plane());
+    scenes.push_back(std::move(solids));
+
+    return scenes;
+}
+
+bool loadBmp(const std::string& path, Image& img)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+    unsigned char header[54];
+    if (fread(header, 1, 54, f) != 54 || header[0] != 'B' || header[1] != 'M')
+    {
+        fclose(f);
+        return false;
+    }
+    std::int32_t w, h;
+    std::memcpy(&w, header + 18, sizeof w);
+    std::memcpy(&h, header + 22, sizeof h);
+    img = Image(w, h);
+
+    const std::size_t            stride = (3 * w + 3) / 4 * 4;
+    std::vector< unsigned char > row(stride);
+    for (std::int32_t j = 0; j < h; j++)
+    {
+        if (fread(row.data(), 1, stride, f) != stride)
+        {
+            fclose(f);
+            return false;
+        }
+        for (std::int32_t i = 0; i < w; i++)
+            img.setPixel(i, j, Color{row[3 * i + 2], row[3 * i + 1], row[3 * i]});
+    }
+    fclose(f);
+    return true;
+}
+
+bool sameFile(const std::string& a, const std::string& b)
+{
+    std::ifstream fa(a, std::ios::binary), fb(b, std::ios::binary);
+    if (!fa || !fb)
+        return false;
+    return std::equal(std::istreambuf_iterator< char >(fa),
+                      std::istreambuf_iterator< char >(),
+                      std::istreambuf_iterator< char >(fb),
+                      std::istreambuf_iterator< char >());
+}
+
+// Returns true when the images match within the tolerance, prints the differences
+bool compare(const std::string& what,
+             const Image&       golden,
+             const Image&       img,
+             int                channelTol = channelTolerance,
+             double             pixelTol   = pixelTolerance)
+{
+    if (golden.getWidth() != img.getWidth() || golden.getHeight() != img.getHeight())
+    {
+        std::cout << "FAIL " << what << ": size " << img.getWidth() << "x" << img.getHeight() << ", golden "
+                  << golden.getWidth() << "x" << golden.getHeight() << std::endl;
+        return false;
+    }
+
+    std::size_t differing = 0, maxDiff = 0;
+    for (std::size_t j = 0; j < img.getHeight(); j++)
+        for (std::size_t i = 0; i < img.getWidth(); i++)
+        {
+            const Pixel a    = golden.getPixel(i, j);
+            const Pixel b    = img.getPixel(i, j);
+            const int   diff = std::max({std::abs(a.r - b.r), std::abs(a.g - b.g), std::abs(a.b - b.b)});
+            maxDiff          = std::max< std::size_t >(maxDiff, diff);
+            differing += diff > channelTol;
+        }
+
+    const double share = static_cast< double >(differing) / (img.getWidth() * img.getHeight());
+    const bool   ok    = share <= pixelTol;
+    std::cout << (ok ? "ok   " : "FAIL ") << what << ": " << differing << " pixels differ by more than "
+              << channelTol << ", max difference " << maxDiff << std::endl;
+    return ok;
+}
+
+// Moves the spheres of the default scene with Render::updateSpheres and compares the BVH render with a CPU render
+// of the moved scene. Small steps keep the refitted tree, maxCostGrowth 1.0 makes the large step rebuild it.
+bool checkSphereUpdates()
+{
+    std::vector< Obj3D* > objs = generateSpheres(1024, 2023);
+    Camera                cam(Eigen::Vector4d(-100.0, -100.0, 30.0, 1.0),
+               Eigen::Vector4d(-90.0, -90.0, 25.0, 1.0),
+               Eigen::Vector4d(0.0, 0.0, 1.0, 0.0),
+               80.0);
+    std::vector< Light > lights = cornerLights();
+    Render               bvh(cam, lights, objs.data(), objs.size());
+    Render               cpu(cam, lights, objs.data(), objs.size());
+    bvh.prepare(width, height);
+    cpu.prepare(width, height);
+    bvh.renderImage(RenderMode::BVH);
+
+    std::mt19937                             mt(3);
+    std::uniform_real_distribution< double > coord(-80, 80);
+    auto move = [&](double step) {
+        std::vector< SphereUpdate > updates;
+        for (std::size_t i = 0; i < objs.size(); i++)
+        {
+            auto*           sphere = static_cast< Sphere* >(objs[i]);
+            Eigen::Vector4d target(coord(mt), coord(mt), sphere->getRadius(), 1.0);
+            updates.push_back({i, sphere->getCenter() + step * (target - sphere->getCenter()), sphere->getRadius()});
+        }
+        bvh.updateSpheres(updates);
+    };
+
+    bool ok = true;
+    for (const auto& [name, step, growth] : {std::tuple{"refit", 0.02, 2.0}, std::tuple{"rebuild", 1.0, 1.0}})
+    {
+        bvh.setMaxBvhCostGrowth(growth);
+        move(step);
+        bvh.renderImage(RenderMode::BVH);
+        cpu.renderImage(RenderMode::CPU);
+        ok &= compare(std::string("updates/") + name, cpu.getImage(), bvh.getImage());
+    }
+
+    for (auto* obj : objs)
+        delete obj;
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <golden dir> [--update]" << std::endl;
+        return 2;
+    }
+    const fs::path golden = argv[1];
+    const bool     update = argc > 2 && std::string(argv[2]) == "--update";
+
+    const std::vector< std::pair< std::string, std::pair< RenderMode, int > > > modes = {
+        {"cpu", {RenderMode::CPU, 8}},
+        {"tbb", {RenderMode::TBB, 8}},
+        {"simd1", {RenderMode::SIMD, 1}},
+        {"simd8", {RenderMode::SIMD, 8}},
+        {"simd128", {RenderMode::SIMD, 128}},
+        {"bvh", {RenderMode::BVH, 8}},
+    };
+
+    bool ok = true;
+    for (auto& scene : referenceScenes())
+    {
+        Render render(scene.cam, scene.lights, scene.objs.data(), scene.objs.size());
+        render.prepare(width, height);
+        const fs::path goldenPath = golden / (scene.name + ".bmp");
+
+        if (update)
+        {
+            render.renderImage(RenderMode::CPU);
+            render.saveTo(goldenPath.string());
+            std::cout << "updated " << goldenPath.string() << std::endl;
+            continue;
+        }
+
+        Image reference;
+        if (!loadBmp(goldenPath.string(), reference))
+        {
+            std::cout << "FAIL " << scene.name << ": can not read " << goldenPath.string() << std::endl;
+            ok = false;
+            continue;
+        }
+
+        for (const auto& [name, mode] : modes)
+        {
+            render.renderImage(mode.first, mode.second);
+            ok &= compare(scene.name + "/" + name, reference, render.getImage());
+        }
+
+        // Banded rendering straight into a file has to produce the same image
+        const fs::path streamed = fs::temp_directory_path() / ("regression_" + scene.name + ".bmp");
+        render.prepare(width, height, 7);
+        render.renderToBmp(RenderMode::BVH, streamed.string());
+        Image fromFile;
+        ok &= loadBmp(streamed.string(), fromFile) && compare(scene.name + "/bvh-banded", reference, fromFile);
+        fs::remove(streamed);
+
+        // AOVs streamed band by band have to match the ones of a full frame
+        const fs::path aovBase = fs::temp_directory_path() / ("regression_" + scene.name);
+        render.setAovMask(AovAll);
+        render.prepare(width, height);
+        render.renderImage(RenderMode::BVH);
+        render.saveAovTo(aovBase.string() + "_full");
+        render.prepare(width, height, 7);
+        render.renderToBmp(RenderMode::BVH, streamed.string(), 8, aovBase.string() + "_banded");
+        for (const char* suffix : {".depth.pfm", ".normal.pfm", ".id.pfm"})
+        {
+            const std::string full   = aovBase.string() + "_full" + suffix;
+            const std::string banded = aovBase.string() + "_banded" + suffix;
+            const bool        same   = sameFile(full, banded);
+            std::cout << (same ? "ok   " : "FAIL ") << scene.name << "/aov-banded" << suffix << std::endl;
+            ok &= same;
+            fs::remove(full);
+            fs::remove(banded);
+        }
+        render.setAovMask(AovNone);
+
+        // With LOD a banded frame has to splat the same spheres as a full one
+        render.setLodThreshold(lodPixels);
+        render.prepare(width, height, 7);
+        render.renderToBmp(RenderMode::BVH, streamed.string());
+        render.prepare(width, height);
+        render.renderImage(RenderMode::BVH);
+        ok &= loadBmp(streamed.string(), fromFile) &&
+              compare(scene.name + "/bvh-banded-lod", render.getImage(), fromFile);
+        // Splats only approximate the outline and shading of the spheres they replace
+        ok &= compare(scene.name + "/bvh-lod", reference, render.getImage(), lodChannelTolerance, lodPixelTolerance);
+        render.setLodThreshold(0.0);
+        fs::remove(streamed);
+
+        for (auto* obj : scene.objs)
+            delete obj;
+    }
+
+    if (!update)
+        ok &= checkSphereUpdates();
+
+    std::cout << (ok ? "All images match" : "Image regression") << std::endl;
+    return ok ? 0 : 1;
+}